@@ -10,9 +10,11 @@
 #include "../src/debug.h"
 #include "../src/vm.h"
 
-static void repl(bool printCode, int argc, char** argv) {
+static void repl(bool printCode, unsigned int gcPause, unsigned int gcThreads, bool gcCompact, bool printGC, size_t profileInterval, int argc, char** argv) {
 	VM vm;
-	initVM(&vm, argc, argv, argc);
+	initVM(&vm, argc, argv, argc, gcPause, gcThreads, gcCompact);
+	if(profileInterval)
+		profileAllocations(&vm, profileInterval);
 	char line[1024];	// TODO there should not be a hardcoded line length.
 
 	while(true) {
@@ -27,12 +29,17 @@ static void repl(bool printCode, int argc, char** argv) {
 		interpret(&vm, line, printCode);
 	}
 
+	if(printGC)
+		printGCStats(&vm);
+	printAllocProfile(&vm);
 	freeVM(&vm);
 }
 
-static void runFile(const char *path, bool printCode, int argc, char** argv, int start) {
+static void runFile(const char *path, bool printCode, unsigned int gcPause, unsigned int gcThreads, bool gcCompact, bool printGC, size_t profileInterval, int argc, char** argv, int start) {
 	VM vm;
-	initVM(&vm, argc, argv, start);
+	initVM(&vm, argc, argv, start, gcPause, gcThreads, gcCompact);
+	if(profileInterval)
+		profileAllocations(&vm, profileInterval);
 	char *source = readFile(path);
 	if(source == NULL) {
 		int errnum = errno;
@@ -42,6 +49,9 @@ static void runFile(const char *path, bool printCode, int argc, char** argv, int
 	}
 	InterpretResult result = interpret(&vm, source, printCode);
 	free(source);
+	if(printGC)
+		printGCStats(&vm);
+	printAllocProfile(&vm);
 	freeVM(&vm);
 
 	if(result == INTERPRET_COMPILE_ERROR) exit(EXIT_COMPILE_ERROR);
@@ -50,17 +60,35 @@ static void runFile(const char *path, bool printCode, int argc, char** argv, int
 
 int main(int argc, char** argv) {
 	bool printCode = false;
+	bool printGC = false;
+	unsigned int gcPause = XAN_DEFAULT_GC_PAUSE;
+	unsigned int gcThreads = 0;
+	bool gcCompact = false;
+	size_t profileInterval = 0;
 	int i = 1;
-	if((argc > 1) && (strcmp(argv[i], "-b") == 0)) {
-		printCode = true;
-		i++;
+	for(; i < argc; i++) {
+		if(strcmp(argv[i], "-b") == 0) {
+			printCode = true;
+		} else if(strcmp(argv[i], "-g") == 0) {
+			printGC = true;
+		} else if(strcmp(argv[i], "-c") == 0) {
+			gcCompact = true;
+		} else if((strcmp(argv[i], "-p") == 0) && (i + 1 < argc)) {
+			gcPause = (unsigned int)strtoul(argv[++i], NULL, 10);
+		} else if((strcmp(argv[i], "-m") == 0) && (i + 1 < argc)) {
+			gcThreads = (unsigned int)strtoul(argv[++i], NULL, 10);
+		} else if((strcmp(argv[i], "-a") == 0) && (i + 1 < argc)) {
+			profileInterval = (size_t)strtoul(argv[++i], NULL, 10);
+		} else {
+			break;
+		}
 	}
 	if(argc == i) {
-		repl(printCode, argc, argv);
+		repl(printCode, gcPause, gcThreads, gcCompact, printGC, profileInterval, argc, argv);
 	} else if(argc >= i+1) {
-		runFile(argv[i], printCode, argc, argv, i);
+		runFile(argv[i], printCode, gcPause, gcThreads, gcCompact, printGC, profileInterval, argc, argv, i);
 	} else {
-		fprintf(stderr, "Usage: %s [path]\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-b] [-g] [-c] [-p microseconds] [-m threads] [-a bytes] [path]\n", argv[0]);
 		exit(64);
 	}
 
@@ -2,12 +2,29 @@
 #define XAN_XAN_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct sObj Obj;
 typedef struct sVM VM;
 
-void initVM(VM *vm, int argc, char** argv, int start);
+#define XAN_DEFAULT_GC_PAUSE 500
+
+// gcPause is the target length, in microseconds, of each step of a major collection.
+// With gcThreads > 0, the heap is marked by that many threads alongside the program, which only stops to start and finish marking.
+// With gcCompact, old objects are moved together once the heap gets fragmented, so that memory can be returned to the system.
+void initVM(VM *vm, int argc, char** argv, int start, unsigned int gcPause, unsigned int gcThreads, bool gcCompact);
 void freeVM(VM *vm);
+void printGCStats(VM *vm);
+// Runs a full collection, after finishing any major cycle in progress.
+void collectAll(VM *vm);
+// Does what the collector would do next: a minor collection, or a step of a major cycle.
+void collectStep(VM *vm);
+// Samples an allocation every interval bytes, and charges the bytes to the line that allocated them.
+void profileAllocations(VM *vm, size_t interval);
+// Prints the allocation sites, heaviest first, with the bytes they made that are still reachable.
+void printAllocProfile(VM *vm);
+// Writes every object reachable from the roots, with its size and what it refers to.  Returns false if the file can't be written.
+bool writeHeapSnapshot(VM *vm, const char *path);
 
 typedef enum {
 	INTERPRET_OK,
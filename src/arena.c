@@ -0,0 +1,208 @@
+#define _DEFAULT_SOURCE	// For MAP_ANONYMOUS.
+#include "arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON(p, size) ASAN_POISON_MEMORY_REGION((p), (size))
+#define UNPOISON(p, size) ASAN_UNPOISON_MEMORY_REGION((p), (size))
+#else /* __SANITIZE_ADDRESS__ */
+#define POISON(p, size) ((void)(p), (void)(size))
+#define UNPOISON(p, size) ((void)(p), (void)(size))
+#endif /* __SANITIZE_ADDRESS__ */
+
+static void pushAvailable(Arena *a, ArenaPage *page, size_t c) {
+	page->prev = NULL;
+	page->next = a->available[c];
+	if(page->next)
+		page->next->prev = page;
+	a->available[c] = page;
+	page->available = true;
+}
+
+static void removeAvailable(Arena *a, ArenaPage *page, size_t c) {
+	if(page->prev)
+		page->prev->next = page->next;
+	else
+		a->available[c] = page->next;
+	if(page->next)
+		page->next->prev = page->prev;
+	page->available = false;
+}
+
+static ArenaPage *newPage(Arena *a, size_t list) {
+	void *memory;
+	if(posix_memalign(&memory, ARENA_PAGE_SIZE, ARENA_PAGE_SIZE) != 0)
+		return NULL;
+	ArenaPage *page = memory;
+	page->free = NULL;
+	page->bump = (char*)page + ARENA_FIRST_CELL;
+	page->end = (char*)page + ARENA_PAGE_SIZE;
+	page->live = 0;
+	page->cellSize = (list % ARENA_CLASSES + 1) * ARENA_CELL_SIZE;
+	page->list = list;
+	page->pins = 0;
+	page->unswept = false;
+	page->evacuating = false;
+	for(size_t i = 0; i < ARENA_BITMAP_WORDS; i++) {
+		page->old[i] = 0;
+		page->marks[i] = 0;
+	}
+	POISON(page->bump, page->end - page->bump);
+	pushAvailable(a, page, list);
+	page->allPrev = NULL;
+	page->allNext = a->pages;
+	if(a->pages)
+		a->pages->allPrev = page;
+	a->pages = page;
+	a->pageCount++;
+	return page;
+}
+
+static void releasePage(Arena *a, ArenaPage *page) {
+	if(page->allPrev)
+		page->allPrev->allNext = page->allNext;
+	else
+		a->pages = page->allNext;
+	if(page->allNext)
+		page->allNext->allPrev = page->allPrev;
+	UNPOISON(page, ARENA_PAGE_SIZE);
+	free(page);
+	a->pageCount--;
+}
+
+void initArena(Arena *a) {
+	for(size_t i = 0; i < ARENA_LISTS; i++)
+		a->available[i] = NULL;
+	for(size_t i = 0; i < ARENA_CLASSES; i++)
+		a->unswept[i] = NULL;
+	a->pages = NULL;
+	a->pageCount = 0;
+}
+
+void *arenaAlloc(Arena *a, size_t size, bool object) {
+	assert((size > 0) && (size <= ARENA_MAX_SIZE));
+	size_t list = arenaList(size, object);
+	ArenaPage *page = a->available[list];
+	if(page == NULL) {
+		page = newPage(a, list);
+		if(page == NULL)
+			return NULL;
+	}
+
+	void *cell;
+	if(page->free) {
+		cell = page->free;
+		UNPOISON(cell, page->cellSize);
+		page->free = *(void**)cell;
+	} else {
+		cell = page->bump;
+		page->bump += page->cellSize;
+		UNPOISON(cell, page->cellSize);
+	}
+	page->live++;
+	if((page->free == NULL) && (page->bump + page->cellSize > page->end))
+		removeAvailable(a, page, list);
+	return cell;
+}
+
+void arenaFree(Arena *a, void *p, __attribute__((unused)) size_t size) {
+	ArenaPage *page = pageOf(p);
+	assert(page->cellSize == (arenaSizeClass(size) + 1) * ARENA_CELL_SIZE);	// Freed with the size it was allocated with.
+	assert(page->live > 0);
+
+	size_t i = cellIndex(page, p);
+	page->old[i / 64] &= ~((uint64_t)1 << (i % 64));
+	*(void**)p = page->free;
+	page->free = p;
+	POISON(p, page->cellSize);
+	page->live--;
+	if(page->evacuating)
+		return;
+	if(!page->available)
+		pushAvailable(a, page, page->list);
+	arenaTrim(a, page);
+}
+
+// An empty page goes back to the system, unless it is the only room left in its class.
+void arenaTrim(Arena *a, ArenaPage *page) {
+	if((page->live == 0) && !page->unswept && ((a->available[page->list] != page) || page->next)) {
+		removeAvailable(a, page, page->list);
+		releasePage(a, page);
+	}
+}
+
+// Nothing more is allocated in the page, so its objects can be moved out.
+void arenaEvacuate(Arena *a, ArenaPage *page) {
+	if(page->available)
+		removeAvailable(a, page, page->list);
+	page->evacuating = true;
+}
+
+// Once every reference to the page's objects has been forwarded, the copies left behind are dropped with it.
+void arenaReleaseEvacuated(Arena *a, ArenaPage *page) {
+	assert(page->evacuating);
+	releasePage(a, page);
+}
+
+// A large allocation is preceded by the size of its mapping, and how much of that can be used.
+typedef struct {
+	size_t reserved;
+	size_t committed;
+} LargeHeader;
+
+static size_t roundToPage(size_t size) {
+	return (size + ARENA_PAGE_SIZE - 1) & ~(size_t)(ARENA_PAGE_SIZE - 1);
+}
+
+// Address space is cheap, so a large allocation reserves room to grow into, and only commits what it uses.
+void *largeAlloc(size_t size) {
+	size_t committed = roundToPage(sizeof(LargeHeader) + size);
+	size_t reserved = committed * ARENA_LARGE_RESERVE;
+	void *base = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED) {
+		reserved = committed;
+		base = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(base == MAP_FAILED)
+			return NULL;
+	}
+	if(mprotect(base, committed, PROT_READ | PROT_WRITE) != 0) {
+		munmap(base, reserved);
+		return NULL;
+	}
+	LargeHeader *h = base;
+	h->reserved = reserved;
+	h->committed = committed;
+	return h + 1;
+}
+
+// Resizes a large allocation without moving it.  Returns false if it has outgrown its reservation.
+bool largeResize(void *p, size_t size) {
+	LargeHeader *h = (LargeHeader*)p - 1;
+	size_t committed = roundToPage(sizeof(LargeHeader) + size);
+	if(committed > h->reserved)
+		return false;
+	if(committed > h->committed) {
+		if(mprotect((char*)h + h->committed, committed - h->committed, PROT_READ | PROT_WRITE) != 0)
+			return false;
+		h->committed = committed;
+	}
+	return true;
+}
+
+void largeFree(void *p) {
+	LargeHeader *h = (LargeHeader*)p - 1;
+	munmap(h, h->reserved);
+}
+
+void freeArena(Arena *a) {
+	while(a->pages) {
+		assert(a->pages->live == 0);	// Every cell was freed with its object.
+		releasePage(a, a->pages);
+	}
+	initArena(a);
+}
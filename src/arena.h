@@ -0,0 +1,74 @@
+#ifndef XAN_ARENA_H
+#define XAN_ARENA_H
+
+#include "type.h"
+
+#include <stdint.h>
+
+#define ARENA_CELLS (ARENA_PAGE_SIZE / ARENA_CELL_SIZE)
+#define ARENA_BITMAP_WORDS (ARENA_CELLS / 64)
+#define ARENA_FIRST_CELL ((sizeof(ArenaPage) + ARENA_CELL_SIZE - 1) & ~(size_t)(ARENA_CELL_SIZE - 1))
+
+// Each page holds cells of a single size class.  Pages are aligned to their size, so a cell finds its page by masking its address.
+// Bits are indexed by a cell's offset in the page, in units of ARENA_CELL_SIZE.
+struct sArenaPage {
+	ArenaPage *next;	// Pages of the same class that have a free cell.
+	ArenaPage *prev;
+	ArenaPage *allNext;	// Every page in the arena.
+	ArenaPage *allPrev;
+	ArenaPage *sweepNext;
+	void *free;			// Cells that have been freed.
+	char *bump;			// Cells that have never been handed out.
+	char *end;
+	size_t live;
+	size_t cellSize;
+	size_t list;		// Which of the arena's available lists the page belongs to.
+	unsigned int pins;	// Objects that C code holds a pointer to, so they can't be moved.
+	bool available;		// In the class's list of pages with a free cell.
+	bool unswept;		// Waiting to be swept, so it stays allocated even if it empties.
+	bool evacuating;	// A compaction is moving its objects out.
+	uint64_t old[ARENA_BITMAP_WORDS];	// Objects that have been promoted out of the nursery.
+	uint64_t marks[ARENA_BITMAP_WORDS];
+};
+
+static inline size_t arenaSizeClass(size_t size) {
+	return (size - 1) / ARENA_CELL_SIZE;
+}
+
+static inline size_t arenaList(size_t size, bool object) {
+	return arenaSizeClass(size) + (object ? ARENA_CLASSES : 0);
+}
+
+static inline bool isObjectPage(const ArenaPage *page) {
+	return page->list >= ARENA_CLASSES;
+}
+
+static inline size_t arenaCapacity(const ArenaPage *page) {
+	return (ARENA_PAGE_SIZE - ARENA_FIRST_CELL) / page->cellSize;
+}
+
+static inline ArenaPage *pageOf(const void *p) {
+	return (ArenaPage*)((uintptr_t)p & ~(uintptr_t)(ARENA_PAGE_SIZE - 1));
+}
+
+static inline size_t cellIndex(const ArenaPage *page, const void *p) {
+	return ((uintptr_t)p - (uintptr_t)page) / ARENA_CELL_SIZE;
+}
+
+static inline void *cellAt(ArenaPage *page, size_t index) {
+	return (char*)page + index * ARENA_CELL_SIZE;
+}
+
+void initArena(Arena *a);
+void *arenaAlloc(Arena *a, size_t size, bool object);
+void arenaFree(Arena *a, void *p, size_t size);
+void arenaTrim(Arena *a, ArenaPage *page);
+void arenaEvacuate(Arena *a, ArenaPage *page);
+void arenaReleaseEvacuated(Arena *a, ArenaPage *page);
+void freeArena(Arena *a);
+
+void *largeAlloc(size_t size);
+bool largeResize(void *p, size_t size);
+void largeFree(void *p);
+
+#endif /* XAN_ARENA_H */
@@ -16,7 +16,9 @@ ObjArray *newArray(VM *vm, thread *currentThread, size_t count) {
 	if(count) {
 		size_t capacity = round_up_pow_2(count);
 		currentThread->base[0] = OBJ_VAL(array);
-		array->values = GROW_ARRAY(vm, array->values, Value, 0, capacity);
+		array->values = ALLOCATE_SLOTS(vm, capacity);
+		for(size_t i = 0; i < count; i++)
+			array->values[i] = NIL_VAL;	// The caller may allocate before filling it in.
 		array->count = count;
 		array->capacity = capacity;
 	}
@@ -74,14 +76,15 @@ static bool ArrayAppend(VM *vm, thread *currentThread, int argCount) {
 
 void writeValueArray(VM *vm, ObjArray *array, Value value) {
 	if(array->capacity < array->count + 1) {
-		size_t oldCapacity = array->capacity;
-		array->capacity = GROW_CAPACITY(oldCapacity);
-		array->values = GROW_ARRAY(vm, array->values, Value, oldCapacity, array->capacity);
+		size_t capacity = GROW_CAPACITY(array->capacity);
+		// Collecting while the buffer grows finds its card table with the old capacity.
+		array->values = GROW_SLOTS(vm, array->values, array->capacity, capacity);
+		array->capacity = capacity;
 	}
 
 	array->values[array->count] = value;
-	writeBarrier(vm, array);
-	array->count++;
+	slotBarrier(vm, (Obj*)array, array->values, array->capacity, array->count);
+	STORE_RELEASE(&array->count, array->count + 1);
 }
 
 NativeDef arrayMethods[] = {
@@ -9,6 +9,7 @@
 #include "chunk.h"
 #include "class.h"
 #include "exception.h"
+#include "memory.h"
 #include "object.h"
 #include "parse.h"
 #include "table.h"
@@ -34,6 +35,7 @@ static bool importNative(VM *vm, thread *currentThread, int argCount) {
 		return false;
 	}
 
+	currentThread->base[0] = OBJ_VAL(internString(vm, AS_STRING(currentThread->base[0])));
 	Value ret = NIL_VAL;
 	if(tableGet(vm->builtinMods, currentThread->base[0], &ret)) {
 		currentThread->base[0] = ret;
@@ -70,7 +72,12 @@ static bool importNative(VM *vm, thread *currentThread, int argCount) {
 			uint32_t op[2] = {OP_ABC(OP_CALL, 0, 0, 0), 0};
 			call(vm, currentThread, cl, 0, 0, &op[1]);
 
+			// The script can return into the interpreter at a point where the heap is compacted.
+			pinObject((Obj*)builtinM);
+			pinObject((Obj*)pathArray);
 			InterpretResult res = run(vm, currentThread);
+			unpinObject((Obj*)pathArray);
+			unpinObject((Obj*)builtinM);
 			currentThread->base[0] = OBJ_VAL(newModule(vm, currentThread, AS_STRING(currentThread->base[0])));
 			decCFrame(currentThread);
 			if(res != INTERPRET_OK)
@@ -110,6 +117,9 @@ ObjClass *BuiltinClasses[] = {
 	&moduleDef,
 	&stringDef,
 	&tableDef,
+	&weakKeyTableDef,
+	&weakValueTableDef,
+	&ephemeronTableDef,
 	NULL
 };
 
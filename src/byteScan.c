@@ -0,0 +1,97 @@
+#include "byteScan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/**********************************************************************************
+  The string methods scan a vector of bytes at a time: 32 with AVX2, and 16 with
+  SSE2, which every x86-64 processor has.  The width is chosen when xan is
+  compiled, so building with -mavx2 (or -march=native) enables the wider one.
+  Elsewhere, and for the bytes left over at the end, the scalar loops are used.
+
+  A search for a longer needle compares each position with the needle's first and
+  last bytes at once, and only calls memcmp where both match.
+ **********************************************************************************/
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define VECTOR_SIZE 32
+	typedef __m256i Vector;
+	#define vectorLoad(p)			_mm256_loadu_si256((const __m256i*)(p))
+	#define vectorStore(p, v)		_mm256_storeu_si256((__m256i*)(p), (v))
+	#define vectorSplat(c)			_mm256_set1_epi8((char)(c))
+	#define vectorEqual(a, b)		_mm256_cmpeq_epi8((a), (b))
+	#define vectorGreater(a, b)		_mm256_cmpgt_epi8((a), (b))
+	#define vectorAnd(a, b)			_mm256_and_si256((a), (b))
+	#define vectorXor(a, b)			_mm256_xor_si256((a), (b))
+	#define vectorMask(v)			((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+	#include <emmintrin.h>
+	#define VECTOR_SIZE 16
+	typedef __m128i Vector;
+	#define vectorLoad(p)			_mm_loadu_si128((const __m128i*)(p))
+	#define vectorStore(p, v)		_mm_storeu_si128((__m128i*)(p), (v))
+	#define vectorSplat(c)			_mm_set1_epi8((char)(c))
+	#define vectorEqual(a, b)		_mm_cmpeq_epi8((a), (b))
+	#define vectorGreater(a, b)		_mm_cmpgt_epi8((a), (b))
+	#define vectorAnd(a, b)			_mm_and_si128((a), (b))
+	#define vectorXor(a, b)			_mm_xor_si128((a), (b))
+	#define vectorMask(v)			((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+static ptrdiff_t findScalar(const char *haystack, size_t length, const char *needle, size_t needleLength, size_t from) {
+	const char *last = haystack + length - needleLength;	// The last place the needle could start.
+	for(const char *p = haystack + from; p <= last; p++) {
+		p = memchr(p, needle[0], last - p + 1);
+		if(p == NULL)
+			return -1;
+		if(memcmp(p + 1, needle + 1, needleLength - 1) == 0)
+			return p - haystack;
+	}
+	return -1;
+}
+
+ptrdiff_t findBytes(const char *haystack, size_t length, const char *needle, size_t needleLength) {
+	if(needleLength == 0)
+		return 0;
+	if(needleLength > length)
+		return -1;
+	size_t i = 0;
+#ifdef VECTOR_SIZE
+	Vector first = vectorSplat(needle[0]);
+	Vector last = vectorSplat(needle[needleLength - 1]);
+	for(; i + needleLength - 1 + VECTOR_SIZE <= length; i += VECTOR_SIZE) {
+		uint32_t candidates = vectorMask(vectorAnd(
+				vectorEqual(first, vectorLoad(haystack + i)),
+				vectorEqual(last, vectorLoad(haystack + i + needleLength - 1))));
+		while(candidates) {
+			size_t offset = i + __builtin_ctz(candidates);
+			if((needleLength <= 2) || (memcmp(haystack + offset + 1, needle + 1, needleLength - 2) == 0))
+				return offset;
+			candidates &= candidates - 1;
+		}
+	}
+#endif /* VECTOR_SIZE */
+	return findScalar(haystack, length, needle, needleLength, i);
+}
+
+void changeCase(char *dest, const char *src, size_t length, bool upper) {
+	char first = upper ? 'a' : 'A';
+	char last = upper ? 'z' : 'Z';
+	size_t i = 0;
+#ifdef VECTOR_SIZE
+	// The comparisons are signed, so bytes above 0x7f are never letters.
+	Vector below = vectorSplat(first - 1);
+	Vector above = vectorSplat(last + 1);
+	Vector bit = vectorSplat(0x20);
+	for(; i + VECTOR_SIZE <= length; i += VECTOR_SIZE) {
+		Vector v = vectorLoad(src + i);
+		Vector letters = vectorAnd(vectorGreater(v, below), vectorGreater(above, v));
+		vectorStore(dest + i, vectorXor(v, vectorAnd(letters, bit)));
+	}
+#endif /* VECTOR_SIZE */
+	for(; i < length; i++) {
+		char c = src[i];
+		dest[i] = ((c >= first) && (c <= last)) ? c ^ 0x20 : c;
+	}
+}
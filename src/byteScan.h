@@ -0,0 +1,13 @@
+#ifndef XAN_BYTE_SCAN_H
+#define XAN_BYTE_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Returns the offset of the first occurrence of needle in haystack, or -1.  An empty needle is found at 0.
+ptrdiff_t findBytes(const char *haystack, size_t length, const char *needle, size_t needleLength);
+
+// Copies src to dest, changing ASCII letters to upper or lower case.  Other bytes are copied as they are.
+void changeCase(char *dest, const char *src, size_t length, bool upper);
+
+#endif /* XAN_BYTE_SCAN_H */
@@ -8,7 +8,10 @@ void initChunk(VM *vm, thread *currentThread, Chunk *chunk) {
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
-	chunk->lines = NULL;
+	chunk->lineInfo = NULL;
+	chunk->lineInfoCount = 0;
+	chunk->lineInfoCapacity = 0;
+	chunk->lastLine = 0;
 	chunk->constants = NULL;		// For GC
 	chunk->constantIndices = NULL;	// For GC
 	incCFrame(vm, currentThread, 1, 3);
@@ -25,17 +28,112 @@ void finalizeChunk(Chunk *chunk) {
 	chunk->constantIndices = NULL;
 }
 
+static void writeLineByte(VM *vm, Chunk *chunk, uint8_t byte) {
+	if(chunk->lineInfoCapacity < chunk->lineInfoCount + 1) {
+		size_t oldCapacity = chunk->lineInfoCapacity;
+		chunk->lineInfoCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->lineInfo = GROW_ARRAY(vm, chunk->lineInfo, uint8_t, oldCapacity, chunk->lineInfoCapacity);
+	}
+	chunk->lineInfo[chunk->lineInfoCount++] = byte;
+}
+
+static void writeLine(VM *vm, Chunk *chunk, size_t line) {
+	if((chunk->lineInfoCount > 0) && (line == chunk->lastLine) && (chunk->lineInfo[chunk->lineInfoCount - 1] < UINT8_MAX)) {
+		chunk->lineInfo[chunk->lineInfoCount - 1]++;
+		return;
+	}
+	size_t zigzag = (line >= chunk->lastLine) ? (line - chunk->lastLine) << 1 : ((chunk->lastLine - line) << 1) - 1;
+	for(; zigzag >= 0x80; zigzag >>= 7)
+		writeLineByte(vm, chunk, (uint8_t)(zigzag | 0x80));
+	writeLineByte(vm, chunk, (uint8_t)zigzag);
+	writeLineByte(vm, chunk, 1);
+	chunk->lastLine = line;
+}
+
+// Decodes the run starting at lineInfo[i], and returns the index of the next run.
+static size_t readLineRun(const Chunk *chunk, size_t i, size_t *line, size_t *length) {
+	size_t zigzag = 0;
+	unsigned int shift = 0;
+	uint8_t byte;
+	do {
+		byte = chunk->lineInfo[i++];
+		zigzag |= (size_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while(byte & 0x80);
+	if(zigzag & 1)
+		*line -= (zigzag + 1) >> 1;
+	else
+		*line += zigzag >> 1;
+	*length = chunk->lineInfo[i++];
+	return i;
+}
+
+void truncateChunk(Chunk *chunk, size_t count) {
+	size_t pc = 0;
+	size_t line = 0;
+	for(size_t i = 0; i < chunk->lineInfoCount;) {
+		size_t runLine = line;
+		size_t length;
+		size_t next = readLineRun(chunk, i, &runLine, &length);
+		if(pc + length >= count) {
+			if(pc == count) {
+				chunk->lineInfoCount = i;
+				chunk->lastLine = line;
+			} else {
+				chunk->lineInfo[next - 1] = (uint8_t)(count - pc);
+				chunk->lineInfoCount = next;
+				chunk->lastLine = runLine;
+			}
+			break;
+		}
+		pc += length;
+		line = runLine;
+		i = next;
+	}
+	chunk->count = count;
+}
+
+size_t getLine(const Chunk *chunk, size_t offset) {
+	size_t pc = 0;
+	size_t line = 0;
+	for(size_t i = 0; i < chunk->lineInfoCount;) {
+		size_t length;
+		i = readLineRun(chunk, i, &line, &length);
+		pc += length;
+		if(offset < pc)
+			break;
+	}
+	return line;
+}
+
+void getLines(const Chunk *chunk, size_t *lines) {
+	size_t pc = 0;
+	size_t line = 0;
+	for(size_t i = 0; i < chunk->lineInfoCount;) {
+		size_t length;
+		i = readLineRun(chunk, i, &line, &length);
+		for(size_t end = pc + length; pc < end; pc++)
+			lines[pc] = line;
+	}
+}
+
+void setLines(VM *vm, Chunk *chunk, const size_t *lines, size_t count) {
+	chunk->lineInfoCount = 0;
+	chunk->lastLine = 0;
+	for(size_t i = 0; i < count; i++)
+		writeLine(vm, chunk, lines[i]);
+}
+
 size_t writeChunk(VM *vm, Chunk *chunk, uint32_t opcode, size_t line) {
 	size_t count = chunk->count;
 	if(chunk->capacity < count + 1) {
 		size_t oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code = GROW_ARRAY(vm, chunk->code, uint32_t, oldCapacity, chunk->capacity);
-		chunk->lines = GROW_ARRAY(vm, chunk->lines, size_t, oldCapacity, chunk->capacity);
 	}
 
 	chunk->code[count] = opcode;
-	chunk->lines[count] = line;
+	writeLine(vm, chunk, line);
 	chunk->count = count + 1;
 	return count;
 }
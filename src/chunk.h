@@ -60,7 +60,10 @@
 	X(OP_END_TRY,			J)sep			/* 50 */ \
 	X(OP_THROW,				A)sep \
 	X(OP_JUMP_IF_NOT_EXC,	AJ)sep \
-	X(OP_INVOKE,			ABCcall)sep
+	X(OP_INVOKE,			ABCcall)sep \
+	X(OP_FORPREP,			ABCfor)sep		/* 55 */ \
+	X(OP_FORLOOP,			ABCfor)sep \
+	X(OP_EXTENDED,			Ext)sep
 #define BUILD_OPCODES(op, _) op
 
 typedef enum {
@@ -100,10 +103,13 @@ static inline Value getPrimitive(primitive p) {
 #define OP_AD(op,a,d) (OP_A((op),(a)) | (((uint32_t) (d)) << 16))
 #define OP_ABC(op,a,b,c) OP_AD((op), (a), (((uint16_t) (b)) | (((uint16_t) (c)) << 8)))
 #define OP_AJump(op,a,j) OP_AD((op), (a), (OP_position)((int32_t)(j)+JUMP_BIAS))
+#define OP_Jump(op,j) (((uint32_t) (op)) | (((uint32_t) ((int32_t)(j)+JUMP_BIAS_LONG)) << 8))
 
 #define MAX_REG 0xff
 #define MAX_D 0xffff
 #define JUMP_BIAS 0x8000
+#define MAX_JUMP_LONG 0xffffff
+#define JUMP_BIAS_LONG 0x800000
 #define NO_REG MAX_REG
 #define NO_JUMP (~(OP_position)0)
 
@@ -112,6 +118,7 @@ static inline Value getPrimitive(primitive p) {
 #define RA(x) ((Reg)(((uint16_t)(MAX_D & ((uint32_t)(x)))) >> 8))
 #define RD(x) ((uint16_t)((x) >> 16))
 #define RJump(x) ((ptrdiff_t)RD(x)-JUMP_BIAS)
+#define RJumpLong(x) ((ptrdiff_t)((uint32_t)(x) >> 8)-JUMP_BIAS_LONG)
 #define RB(x) ((Reg)(MAX_REG & RD(x)))
 #define RC(x) ((Reg)(RD(x) >> 8))
 
@@ -126,9 +133,35 @@ static inline void setbc_d(uint32_t *p, uint16_t x) {
 #define setbc_b(p, x)	setbc(p, (x), 2)
 #define setbc_c(p, x)	setbc(p, (x), 3)
 
+// OP_JUMP and OP_END_TRY have no register operand, so their offset uses A and D together.
+static inline bool isLongJump(ByteCode op) {
+	return (op == OP_JUMP) || (op == OP_END_TRY);
+}
+
+static inline ptrdiff_t getJumpOffset(uint32_t bc) {
+	return isLongJump(OP(bc)) ? RJumpLong(bc) : RJump(bc);
+}
+
+static inline bool setJumpOffset(uint32_t *p, ptrdiff_t offset) {
+	if(isLongJump(OP(*p))) {
+		if((offset < -JUMP_BIAS_LONG) || (offset > MAX_JUMP_LONG - JUMP_BIAS_LONG))
+			return false;
+		*p = OP_Jump(OP(*p), offset);
+	} else {
+		if((offset < -JUMP_BIAS) || (offset > MAX_D - JUMP_BIAS))
+			return false;
+		setbc_d(p, (uint16_t)(offset + JUMP_BIAS));
+	}
+	return true;
+}
+
 void initChunk(VM *vm, thread *currentThread, Chunk *chunk);
 void finalizeChunk(Chunk *chunk);
 size_t writeChunk(VM *vm, Chunk *chunk, uint32_t opcode, size_t line);
+void truncateChunk(Chunk *chunk, size_t count);
+size_t getLine(const Chunk *chunk, size_t offset);
+void getLines(const Chunk *chunk, size_t *lines);
+void setLines(VM *vm, Chunk *chunk, const size_t *lines, size_t count);
 size_t addConstant(VM *vm, Chunk *chunk, Value value);	// Caller is responsible to ensure that value is findable by the GC.
 
 #endif /* XAN_CHUNK_H */
@@ -11,9 +11,14 @@
 #undef DEBUG_TRACE_EXECUTION
 #undef DEBUG_STACK_USAGE
 #undef DEBUG_UPVALUE_USAGE
-#undef DEBUG_STRESS_GC
 #undef DEBUG_LOG_GC
 
+#ifdef XAN_STRESS	// make stress
+	#define DEBUG_STRESS_GC
+#else
+	#undef DEBUG_STRESS_GC
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 	#define COMPUTED_GOTO
 #elif defined(_MSC_VER)
@@ -28,7 +33,23 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define GC_HEAP_GROW_FACTOR 2
-#define GC_MINOR_HEAP_GROW_FACTOR 1.25
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_STEP_SIZE (32 * 1024)	// Bytes allocated between the steps of a major cycle.
+#define GC_STEP_WORK 4096			// Objects a step processes, unless it runs out of time first.
+#define GC_STEP_BATCH 64			// Objects processed between checks of the clock.
+#define GC_PAUSE_BUCKETS 496		// 8 per power of 2 of nanoseconds.
+#define GC_COMPACT_OCCUPANCY 0.5	// With compaction on, the arena is compacted when its object pages are emptier than this.
+#define GC_COMPACT_MIN_PAGES 16		// Smaller heaps aren't worth compacting.
+#define GC_CARD_SIZE 128			// Slots of an array or table covered by each card.
+#define GC_CARD_MIN 1024			// Smaller arrays and tables are rescanned whole.
+#define ARENA_PAGE_SIZE (64 * 1024)
+#define ARENA_MAX_SIZE 256			// Larger allocations go to malloc, unless they are large enough to be mapped.
+#define ARENA_LARGE_SIZE (64 * 1024)	// Allocations this big are mapped on their own.
+#define ARENA_LARGE_RESERVE 8		// Address space reserved for a large allocation to grow into, as a multiple of its size.
+#define ARENA_CELL_SIZE 8			// The spacing of size classes, so objects with a one word header get a class of their own.
+#define ARENA_CLASSES (ARENA_MAX_SIZE / ARENA_CELL_SIZE)
+#define ARENA_LISTS (2 * ARENA_CLASSES)		// Objects and buffers are kept in separate pages.
+#define ROPE_MIN_LENGTH 64			// Shorter concatenations are copied at once, rather than made into a rope.
 
 #define EXIT_COMPILE_ERROR 65
 #define EXIT_RUNTIME_ERROR 70
@@ -23,6 +23,18 @@ static void InstructionABCcall(const char *name, __attribute__((unused)) Chunk *
 	printf("%-16s call Reg %4d with arg count %4d returning %4d\n", name, regA, regC, regB);
 }
 
+static void InstructionABCfor(const char *name, __attribute__((unused)) Chunk *chunk, uint32_t bytecode) {
+	uint8_t reg = RA(bytecode);
+	const char *cmp = "?";
+	switch(RB(bytecode)) {
+		case OP_LESS:    cmp = "<"; break;
+		case OP_LEQ:     cmp = "<="; break;
+		case OP_GREATER: cmp = ">"; break;
+		case OP_GEQ:     cmp = ">="; break;
+	}
+	printf("%-16s Reg %4d %-2s Reg %4d step Reg %4d\n", name, reg, cmp, reg + 1, reg + 2);
+}
+
 static void InstructionAD(const char *name, __attribute__((unused)) Chunk *chunk, uint32_t bytecode) {
 	uint8_t reg = RA(bytecode);
 	uint16_t constant = RD(bytecode);
@@ -71,8 +83,13 @@ static void InstructionD(const char *name, __attribute__((unused)) Chunk *chunk,
 }
 
 static void InstructionJ(const char *name, __attribute__((unused)) Chunk *chunk, uint32_t bytecode) {
-	int16_t constant = RJump(bytecode);
-	printf("%-16s jump %4d\n", name, constant);
+	ptrdiff_t constant = RJumpLong(bytecode);
+	printf("%-16s jump %4td\n", name, constant);
+}
+
+static void InstructionExt(const char *name, __attribute__((unused)) Chunk *chunk, uint32_t bytecode) {
+	uint16_t high = RD(bytecode);
+	printf("%-16s constant %4d << 8 | next RC\n", name, high);
 }
 
 static void InstructionAJ(const char *name, __attribute__((unused)) Chunk *chunk, uint32_t bytecode) {
@@ -85,10 +102,11 @@ void disassembleInstruction(Chunk* chunk, size_t offset) {
 	uint32_t bytecode = chunk->code[offset];
 	printf("%p %04zu %08x ",chunk->code + offset, offset, bytecode);
 
-	if(offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+	size_t line = getLine(chunk, offset);
+	if(offset > 0 && line == getLine(chunk, offset - 1)) {
 		printf("   | ");
 	} else {
-		printf("%4zu ", chunk->lines[offset]);
+		printf("%4zu ", line);
 	}
 #define BUILD_DISASSEMBLY(op, type) \
 	case op: \
@@ -31,11 +31,12 @@ void ExceptionFormattedStr(VM *vm, thread *currentThread, const char* format, ..
 	va_copy(args2, args1);
 	size_t length = vsnprintf(NULL, 0, format, args1);
 	va_end(args1);
-	char *buffer = ALLOCATE(vm, char, length+1);
-	vsnprintf(buffer, length + 1, format, args2);
+	ObjString *msg = allocateString(vm, currentThread, length);
+	vsnprintf(msg->chars, length + 1, format, args2);
 	va_end(args2);
 	
-	exc->msg = OBJ_VAL(takeString(vm, currentThread, buffer, length));
+	exc->msg = OBJ_VAL(msg);
+	writeBarrier(vm, exc);
 	exc->topBase = currentThread->base - currentThread->stack;
 }
 
@@ -10,6 +10,9 @@ typedef struct {
 	Value msg;
 	size_t topBase;
 } ObjException;
+#if UINTPTR_MAX == UINT64_MAX
+XAN_STATIC_ASSERT(sizeof(ObjException) == 32 + sizeof(Value));
+#endif
 
 void ExceptionFormattedStr(VM *vm, thread *currentThread, const char* format, ...);
 
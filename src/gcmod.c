@@ -0,0 +1,149 @@
+#include "gcmod.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include "exception.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "xanString.h"
+
+// The tables are built in a frame of their own.  base[0] keeps each key alive while it is added, and base[1] and base[2] hold the tables.
+static void setNumber(VM *vm, thread *currentThread, ObjTable *t, const char *name, double value) {
+	ObjString *key = copyString(vm, currentThread, name, strlen(name));
+	tableSet(vm, t, OBJ_VAL(key), NUMBER_VAL(value));
+}
+
+static bool expectNoArguments(VM *vm, thread *currentThread, const char *name, int argCount) {
+	if(argCount == 0)
+		return true;
+	ExceptionFormattedStr(vm, currentThread, "Function '%s' expected 0 argument but got %d.", name, argCount);
+	return false;
+}
+
+static bool gcCollect(VM *vm, thread *currentThread, int argCount) {
+	if(!expectNoArguments(vm, currentThread, "collect", argCount))
+		return false;
+	collectAll(vm);
+	currentThread->base[0] = NIL_VAL;
+	return true;
+}
+
+static bool gcStep(VM *vm, thread *currentThread, int argCount) {
+	if(!expectNoArguments(vm, currentThread, "step", argCount))
+		return false;
+	collectStep(vm);
+	currentThread->base[0] = NIL_VAL;
+	return true;
+}
+
+static bool gcSnapshot(VM *vm, thread *currentThread, int argCount) {
+	if(argCount != 1) {
+		ExceptionFormattedStr(vm, currentThread, "Function 'snapshot' expected 1 argument but got %d.", argCount);
+		return false;
+	}
+	if(!IS_STRING(currentThread->base[0])) {
+		ExceptionFormattedStr(vm, currentThread, "Function 'snapshot' expected a string.");
+		return false;
+	}
+	if(!writeHeapSnapshot(vm, AS_CSTRING(currentThread->base[0]))) {
+		ExceptionFormattedStr(vm, currentThread, "Cannot write heap snapshot '%s'.", AS_CSTRING(currentThread->base[0]));
+		return false;
+	}
+	currentThread->base[0] = NIL_VAL;
+	return true;
+}
+
+static bool gcStats(VM *vm, thread *currentThread, int argCount) {
+	if(!expectNoArguments(vm, currentThread, "stats", argCount))
+		return false;
+	GarbageCollector *gc = &vm->gc;
+	incCFrame(vm, currentThread, 2, argCount + 3);
+	ObjTable *t = newTable(vm, currentThread, 16);
+	currentThread->base[1] = OBJ_VAL(t);
+	setNumber(vm, currentThread, t, "collections", gc->pauseCount);
+	setNumber(vm, currentThread, t, "minor", gc->minorCollections);
+	setNumber(vm, currentThread, t, "major", gc->majorCycles);
+	setNumber(vm, currentThread, t, "pauseTotal", gc->pauseTotal / 1e6);
+	setNumber(vm, currentThread, t, "pauseMax", gc->pauseMax / 1e6);
+	setNumber(vm, currentThread, t, "p50", gc->pauseCount ? pausePercentile(gc, 50) : 0);
+	setNumber(vm, currentThread, t, "p90", gc->pauseCount ? pausePercentile(gc, 90) : 0);
+	setNumber(vm, currentThread, t, "p99", gc->pauseCount ? pausePercentile(gc, 99) : 0);
+	setNumber(vm, currentThread, t, "heap", gc->bytesAllocated);
+	setNumber(vm, currentThread, t, "nextMajor", gc->nextMajorGC);
+	setNumber(vm, currentThread, t, "pages", gc->arena.pageCount);
+	setNumber(vm, currentThread, t, "compactions", gc->compactions);
+	decCFrame(currentThread);
+	currentThread->base[0] = OBJ_VAL(t);
+	return true;
+}
+
+// Maps the start of each bucket of the pause histogram, in milliseconds, to the number of pauses in it.
+static bool gcPauses(VM *vm, thread *currentThread, int argCount) {
+	if(!expectNoArguments(vm, currentThread, "pauses", argCount))
+		return false;
+	GarbageCollector *gc = &vm->gc;
+	incCFrame(vm, currentThread, 2, argCount + 3);
+	ObjTable *t = newTable(vm, currentThread, 0);
+	currentThread->base[1] = OBJ_VAL(t);
+	for(size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+		if(gc->pauses[i])
+			tableSet(vm, t, NUMBER_VAL(pauseBucketStart(i)), NUMBER_VAL(gc->pauses[i]));
+	}
+	decCFrame(currentThread);
+	currentThread->base[0] = OBJ_VAL(t);
+	return true;
+}
+
+// Maps each type of object, named like "bound_method", to a table of its counts.
+static bool gcTypes(VM *vm, thread *currentThread, int argCount) {
+	if(!expectNoArguments(vm, currentThread, "types", argCount))
+		return false;
+	GarbageCollector *gc = &vm->gc;
+	incCFrame(vm, currentThread, 2, argCount + 3);
+	ObjTable *t = newTable(vm, currentThread, OBJ_TYPE_COUNT);
+	currentThread->base[1] = OBJ_VAL(t);
+	for(size_t i = 0; i < OBJ_TYPE_COUNT; i++) {
+		TypeStats *stats = &gc->types[i];
+		ObjTable *counts = newTable(vm, currentThread, 6);
+		currentThread->base[2] = OBJ_VAL(counts);
+		setNumber(vm, currentThread, counts, "allocated", stats->allocated);
+		setNumber(vm, currentThread, counts, "freed", stats->freed);
+		setNumber(vm, currentThread, counts, "live", stats->allocated - stats->freed);
+		setNumber(vm, currentThread, counts, "bytesAllocated", stats->bytesAllocated);
+		setNumber(vm, currentThread, counts, "bytesFreed", stats->bytesFreed);
+		setNumber(vm, currentThread, counts, "liveBytes", stats->bytesAllocated - stats->bytesFreed);
+
+		const char *name = ObjTypeNames[i] + strlen("OBJ_");
+		size_t length = strlen(name);
+		char lower[length];
+		for(size_t j = 0; j < length; j++)
+			lower[j] = (char)tolower((unsigned char)name[j]);
+		ObjString *key = copyString(vm, currentThread, lower, length);
+		tableSet(vm, t, OBJ_VAL(key), OBJ_VAL(counts));
+	}
+	decCFrame(currentThread);
+	currentThread->base[0] = OBJ_VAL(t);
+	return true;
+}
+
+ObjClass *GCClasses[] = {
+	NULL
+};
+
+NativeDef GCMethods[] = {
+	{"collect", gcCollect},
+	{"pauses", gcPauses},
+	{"snapshot", gcSnapshot},
+	{"stats", gcStats},
+	{"step", gcStep},
+	{"types", gcTypes},
+	{NULL, NULL},
+};
+
+ModuleDef GCDef = {
+	"gc",
+	GCClasses,
+	GCMethods
+};
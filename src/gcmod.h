@@ -0,0 +1,8 @@
+#ifndef XAN_GCMOD_H
+#define XAN_GCMOD_H
+
+#include "type.h"
+
+extern ModuleDef GCDef;
+
+#endif /* XAN_GCMOD_H */
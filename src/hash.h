@@ -0,0 +1,112 @@
+#ifndef XAN_HASH_H
+#define XAN_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arch.h"
+
+/**********************************************************************************
+  The hash of string and number keys.  Tables probe with the low bits, so every bit
+  of the key has to reach them.  Strings are read a word at a time, in four
+  independent lanes once they are long enough, following xxHash64.  Both finish
+  with the same avalanche.  unittest/test_hash.c checks the spread of the probes,
+  and compares it with byte at a time FNV-1a when given "bench".
+ **********************************************************************************/
+
+#define HASH_PRIME1 0x9E3779B185EBCA87u
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Fu
+#define HASH_PRIME3 0x165667B19E3779F9u
+#define HASH_PRIME4 0x85EBCA77C2B2AE63u
+#define HASH_PRIME5 0x27D4EB2F165667C5u
+
+static inline uint64_t hashRotate(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+// Unaligned little endian reads, which compile to a single load, so a string hashes the same everywhere and tables list their keys in the same order.
+static inline uint64_t hashRead64(const char *p) {
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return ENDIAN_SELECT(x, __builtin_bswap64(x));
+}
+
+static inline uint32_t hashRead32(const char *p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return ENDIAN_SELECT(x, __builtin_bswap32(x));
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+	acc += input * HASH_PRIME2;
+	return hashRotate(acc, 31) * HASH_PRIME1;
+}
+
+static inline uint64_t hashMerge(uint64_t acc, uint64_t lane) {
+	acc ^= hashRound(0, lane);
+	return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+static inline uint64_t hashAvalanche(uint64_t h) {
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+static inline uint32_t hashBytes(const char *key, size_t length) {
+	const char *p = key;
+	const char *end = key + length;
+	uint64_t h;
+
+	if(length >= 32) {
+		uint64_t v1 = HASH_PRIME1 + HASH_PRIME2;
+		uint64_t v2 = HASH_PRIME2;
+		uint64_t v3 = 0;
+		uint64_t v4 = -HASH_PRIME1;
+		do {
+			v1 = hashRound(v1, hashRead64(p));
+			v2 = hashRound(v2, hashRead64(p + 8));
+			v3 = hashRound(v3, hashRead64(p + 16));
+			v4 = hashRound(v4, hashRead64(p + 24));
+			p += 32;
+		} while(p + 32 <= end);
+		h = hashRotate(v1, 1) + hashRotate(v2, 7) + hashRotate(v3, 12) + hashRotate(v4, 18);
+		h = hashMerge(h, v1);
+		h = hashMerge(h, v2);
+		h = hashMerge(h, v3);
+		h = hashMerge(h, v4);
+	} else {
+		h = HASH_PRIME5;
+	}
+	h += length;
+
+	for(; p + 8 <= end; p += 8) {
+		h ^= hashRound(0, hashRead64(p));
+		h = hashRotate(h, 27) * HASH_PRIME1 + HASH_PRIME4;
+	}
+	if(p + 4 <= end) {
+		h ^= hashRead32(p) * HASH_PRIME1;
+		h = hashRotate(h, 23) * HASH_PRIME2 + HASH_PRIME3;
+		p += 4;
+	}
+	for(; p < end; p++) {
+		h ^= (unsigned char)*p * HASH_PRIME5;
+		h = hashRotate(h, 11) * HASH_PRIME1;
+	}
+	return (uint32_t)hashAvalanche(h);
+}
+
+// Numbers that compare equal hash equally, so -0 is hashed as 0.
+static inline uint32_t hashNumber(double x) {
+	if(x == 0)
+		x = 0;
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return (uint32_t)hashAvalanche(bits * HASH_PRIME1);
+}
+
+#endif /* XAN_HASH_H */
@@ -1,31 +1,48 @@
 #include "memory.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "arena.h"
 #include "chunk.h"
 #include "object.h"
+#include "profile.h"
 #include "table.h"
 #include "exception.h"
+#include "hash.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif /* DEBUG_LOG_GC */
 
-static void pushGrayStack(GarbageCollector *gc, Obj *o) {
-	if(gc->grayCapacity < gc->grayCount+1) {
-		gc->grayCapacity = GROW_CAPACITY(gc->grayCapacity);
-		gc->grayStack = realloc(gc->grayStack, sizeof(Obj*) * gc->grayCapacity);
+static void pushGrayStack(GrayStack *s, Obj *o) {
+	if(s->capacity < s->count+1) {
+		s->capacity = GROW_CAPACITY(s->capacity);
+		s->items = realloc(s->items, sizeof(Obj*) * s->capacity);
 	}
-	gc->grayStack[gc->grayCount++] = o;
+	s->items[s->count++] = o;
+}
+
+// The vectors of objects live outside the heap, so growing them can't trigger a collection.
+void growObjects(ObjVector *v) {
+	v->capacity = GROW_CAPACITY(v->capacity);
+	v->items = realloc(v->items, sizeof(Obj*) * v->capacity);
 }
 
-static void markObject(GarbageCollector *gc, Obj *o) {
+static void markObject(GrayStack *s, Obj *o) {
 	if(o == NULL)
 		return;
-	if(o->isBlack)
+	if(isBlack(s->gc, o))
 		return;
+	if(s->shared) {
+		if(!claimMark(o, s->gc->blackMark))
+			return;	// Another marking thread got to it first.
+	} else {
+		setMark(o, s->gc->blackMark);
+	}
 #ifdef DEBUG_LOG_GC
 	printf("%p mark ", (void*)o);
 	if((o->type == OBJ_CLASS) && ((ObjClass*)o)->name == NULL) {
@@ -37,32 +54,56 @@ static void markObject(GarbageCollector *gc, Obj *o) {
 	}
 	printf("\n");
 #endif /* DEBUG_LOG_GC */
-	o->isBlack = true;
-	pushGrayStack(gc, o);
+	pushGrayStack(s, o);
 }
 
-void markValue(GarbageCollector *gc, Value v) {
+void markValue(GrayStack *s, Value v) {
 	if(IS_OBJ(v))
-		markObject(gc, AS_OBJ(v));
+		markObject(s, AS_OBJ(v));
+}
+
+// Marks the first count slots of an array's or table's buffer.  Once a card table has been scanned in this cycle, only its dirty cards need scanning again.
+void markSlots(GrayStack *s, Value *slots, size_t capacity, size_t count) {
+	// The program dirties cards while the workers mark, so they leave the cards alone.
+	if(s->shared || !hasCards(capacity)) {
+		for(size_t i=0; i<count; i++)
+			markValue(s, slots[i]);
+		return;
+	}
+	CardTable *cards = cardsOf(slots, capacity);
+	if(cards->epoch != s->gc->cardEpoch) {
+		cards->epoch = s->gc->cardEpoch;
+		memset(cards->dirty, 0, cardCount(capacity));
+		for(size_t i=0; i<count; i++)
+			markValue(s, slots[i]);
+		return;
+	}
+	for(size_t c = 0; c < cardCount(count); c++) {
+		if(!cards->dirty[c])
+			continue;
+		cards->dirty[c] = 0;
+		size_t end = (c + 1) * GC_CARD_SIZE < count ? (c + 1) * GC_CARD_SIZE : count;
+		for(size_t i = c * GC_CARD_SIZE; i < end; i++)
+			markValue(s, slots[i]);
+	}
 }
 
-static void markArray(GarbageCollector *gc, ObjArray *array) {
-	array->obj.isBlack = true;
-	for(size_t i=0; i<array->count; i++)
-		markValue(gc, array->values[i]);
+static void markArray(GrayStack *s, ObjArray *array) {
+	size_t count = LOAD_ACQUIRE(&array->count);
+	markSlots(s, array->values, array->capacity, count);
 }
 
-static void markCompilerRoots(GarbageCollector *gc, thread *t) {
+static void markCompilerRoots(GrayStack *s, thread *t) {
 	for(Compiler *c = t->currentCompiler; c != NULL; c = c->enclosing) {
-		markObject(gc, (Obj*)c->name);
-		markObject(gc, (Obj*)c->chunk.constants);
-		markObject(gc, (Obj*)c->chunk.constantIndices);
+		markObject(s, (Obj*)c->name);
+		markObject(s, (Obj*)c->chunk.constants);
+		markObject(s, (Obj*)c->chunk.constantIndices);
 	}
 	for(ClassCompiler *c = t->currentClassCompiler; c != NULL; c = c->enclosing)
-		markObject(gc, (Obj*)c->methods);
+		markObject(s, (Obj*)c->methods);
 }
 
-static void markThread(GarbageCollector *gc, thread *t) {
+static void markThread(GrayStack *s, thread *t) {
 #ifdef DEBUG_LOG_GC
 	printf("stackTop = %ld (%p)\n", t->stackTop - t->stack, (void*)t->stackTop);
 #endif /* DEBUG_LOG_GC */
@@ -73,14 +114,14 @@ static void markThread(GarbageCollector *gc, thread *t) {
 #ifdef DEBUG_LOG_GC
 			printf("Marking %zx at stack[%zu]\n", slot->u, slot - t->stack);
 #endif /* DEBUG_LOG_GC */
-			markValue(gc, *slot);
+			markValue(s, *slot);
 		}
 		if(slot <= t->stack)
 			break;
 #ifdef DEBUG_LOG_GC
 		printf("Marking %zx at stack[%zu]\n", slot->u, slot - t->stack);
 #endif /* DEBUG_LOG_GC */
-		markValue(gc, *--slot);	// mark base[-3]
+		markValue(s, *--slot);	// mark base[-3]
 		assert(slot >= t->stack);
 		assert(base >= t->stack + 3);
 		if(IS_NIL(*slot)) {
@@ -92,27 +133,35 @@ static void markThread(GarbageCollector *gc, thread *t) {
 			base -= ra + 2;
 		}
 	}
-	assert((t->stack == NULL) || !IS_OBJ(*t->stack) || AS_OBJ(*t->stack)->isBlack);	// Have we traversed the stack all the way to the bottom?
+	assert((t->stack == NULL) || !IS_OBJ(*t->stack) || isBlack(s->gc, AS_OBJ(*t->stack)));	// Have we traversed the stack all the way to the bottom?
 
-	markValue(gc, t->exception);
+	markValue(s, t->exception);
 
 	for(ObjUpvalue *u = t->openUpvalues; u != NULL; u = u->next)
-		markObject(gc, (Obj*)u);
-	markCompilerRoots(gc, t);
+		markObject(s, (Obj*)u);
+	markCompilerRoots(s, t);
 }
 
 static void markRoots(VM *vm) {
-	markObject(&vm->gc, (Obj*)vm->initString);
-	markObject(&vm->gc, (Obj*)vm->newString);
+	markObject(&vm->gc.gray, (Obj*)vm->initString);
+	markObject(&vm->gc.gray, (Obj*)vm->newString);
+	for(int c = 0; c < 256; c++)
+		markObject(&vm->gc.gray, (Obj*)vm->characters[c]);
+
+	markObject(&vm->gc.gray, (Obj*)vm->globals);
+	markObject(&vm->gc.gray, (Obj*)vm->builtinMods);
+	markObject(&vm->gc.gray, (Obj*)vm->strings);	// Its strings are weak, and are removed as they are freed.
+	markObject(&vm->gc.gray, (Obj*)vm->baseThread);
+}
 
-	markObject(&vm->gc, (Obj*)vm->globals);
-	// We don't want to mark the entries, so we'll manually mark vm->strings here.
-	if(vm->strings)
-		((Obj*)vm->strings)->isBlack = true;
-	markObject(&vm->gc, (Obj*)vm->baseThread);
+// Marks a thread without putting it on the gray stack, so the marker thread never reads a stack that is in use.
+static void scanThread(GrayStack *s, thread *t) {
+	setMark(&t->obj, s->gc->blackMark);
+	t->obj.isGrey = false;
+	markThread(s, t);
 }
 
-static void blackenObject(GarbageCollector *gc, Obj *o) {
+static void blackenObject(GrayStack *s, Obj *o) {
 #ifdef DEBUG_LOG_GC
 	printf("%p blacken ", (void*)o);
 	if((o->type == OBJ_CLASS) && ((ObjClass*)o)->name == NULL) {
@@ -128,93 +177,162 @@ static void blackenObject(GarbageCollector *gc, Obj *o) {
 	switch(o->type) {
 		case OBJ_ARRAY: {
 			ObjArray *array = (ObjArray*)o;
-			markObject(gc, (Obj*)array->klass);
-			markObject(gc, (Obj*)array->fields);
-			markArray(gc, array);
+			markObject(s, (Obj*)array->klass);
+			markObject(s, (Obj*)array->fields);
+			markArray(s, array);
 			break;
 		}
 		case OBJ_BOUND_METHOD: {
 			ObjBoundMethod *bound = (ObjBoundMethod*)o;
-			markValue(gc, bound->receiver);
-			markObject(gc, (Obj*)bound->method);
+			markValue(s, bound->receiver);
+			markObject(s, (Obj*)bound->method);
 			break;
 		}
 		case OBJ_CLASS: {
 			ObjClass *klass = (ObjClass*)o;
-			markObject(gc, (Obj*)klass->name);
-			markObject(gc, (Obj*)klass->methods);
+			markObject(s, (Obj*)klass->name);
+			markObject(s, (Obj*)klass->methods);
 			break;
 		}
 		case OBJ_CLOSURE: {
 			ObjClosure *cl = (ObjClosure*)o;
-			markObject(gc, (Obj*)cl->f);
+			markObject(s, (Obj*)cl->f);
 			for(size_t i=0; i<cl->uvCount; i++)
-				markObject(gc, (Obj*)cl->upvalues[i]);
+				markObject(s, (Obj*)cl->upvalues[i]);
 			break;
 		}
 		case OBJ_FUNCTION: {
 			ObjFunction *f = (ObjFunction*)o;
-			markObject(gc, (Obj*)f->name);
-			markObject(gc, (Obj*)f->chunk.constants);
-			markObject(gc, (Obj*)f->chunk.constantIndices);
+			markObject(s, (Obj*)f->name);
+			markObject(s, (Obj*)f->chunk.constants);
+			markObject(s, (Obj*)f->chunk.constantIndices);
 			break;
 		}
 		case OBJ_INSTANCE: {
 			ObjInstance *instance = (ObjInstance*)o;
-			markObject(gc, (Obj*)instance->klass);
-			markObject(gc, (Obj*)instance->fields);
+			markObject(s, (Obj*)instance->klass);
+			markObject(s, (Obj*)instance->fields);
 			break;
 		}
 		case OBJ_MODULE: {
 			ObjModule *module = (ObjModule*)o;
-			markObject(gc, (Obj*)module->name);
-			markObject(gc, (Obj*)module->fields);
-			markObject(gc, (Obj*)module->klass);
+			markObject(s, (Obj*)module->name);
+			markObject(s, (Obj*)module->fields);
+			markObject(s, (Obj*)module->klass);
 			break;
 		}
 		case OBJ_TABLE:
-			markTable(gc, (ObjTable*) o);
+			markTable(s, (ObjTable*) o);
 			break;
 		case OBJ_UPVALUE:
-			markValue(gc, ((ObjUpvalue*)o)->closed);
+			markValue(s, ((ObjUpvalue*)o)->closed);
 			break;
 		case OBJ_EXCEPTION: {
 			ObjException *e = (ObjException*)o;
-			markObject(gc, (Obj*)e->klass);
-			markObject(gc, (Obj*)e->fields);
-			markValue(gc, e->msg);
+			markObject(s, (Obj*)e->klass);
+			markObject(s, (Obj*)e->fields);
+			markValue(s, e->msg);
 			break;
 		}
 		case OBJ_STRING: {
-			ObjString *s = (ObjString*)o;
-			markObject(gc, (Obj*)s->klass);
-			markObject(gc, (Obj*)s->fields);
+			ObjString *string = (ObjString*)o;
+			markObject(s, (Obj*)string->klass);
+			markObject(s, (Obj*)string->fields);
+			if(!string->interned && s->gc->weakKeyTables && (s->gc->phase == GC_MARK))
+				pushObject(&s->strings, o);
+			break;
+		}
+		case OBJ_ROPE: {
+			ObjRope *rope = (ObjRope*)o;
+			markObject(s, rope->left);
+			markObject(s, rope->right);
 			break;
 		}
 		case OBJ_THREAD: {
 			thread *t = (thread*)o;
-			markThread(gc, t);
+			markThread(s, t);
 		}
 		case OBJ_NATIVE:
 			break;
 	}
 }
 
-static void traceReferences(GarbageCollector *gc) {
-	while(gc->grayCount > 0) {
-		Obj *o = gc->grayStack[--gc->grayCount];
-		blackenObject(gc, o);
+static void traceReferences(GrayStack *s) {
+	while(s->count > 0) {
+		Obj *o = s->items[--s->count];
+		blackenObject(s, o);
+	}
+}
+
+// Equal strings are only the same object once one is interned, so a weak key is kept by any reachable string equal to it.
+// Marks the interned strings equal to those that marking has found since *done.  Returns true if that marked anything.
+static bool markInternedEquals(GrayStack *s, size_t *done) {
+	size_t count = s->count;
+	for(; *done < s->strings.count; (*done)++) {
+		ObjString *string = (ObjString*)s->strings.items[*done];
+		if(string->interned)
+			continue;	// Allocated black by linkObject, and interned since.
+		uint32_t hash = hashBytes(string->chars, string->length);
+		markObject(s, (Obj*)tableFindString(s->gc->strings, string->chars, string->length, hash));
+	}
+	return s->count > count;
+}
+
+// Marking an ephemeron's value can mark the key of another, so this runs until nothing new is marked.  Then the weak tables let go of what is left white.
+static void clearWeakTables(GrayStack *s) {
+	size_t strings = 0;
+	bool marked;
+	do {
+		marked = markInternedEquals(s, &strings);
+		for(size_t i = 0; i < s->weak.count; i++)
+			marked |= markEphemeron(s, (ObjTable*)s->weak.items[i]);
+		traceReferences(s);
+	} while(marked);
+	for(size_t i = 0; i < s->weak.count; i++)
+		tableRemoveWhite(s->gc, (ObjTable*)s->weak.items[i]);
+	s->weak.count = 0;
+	s->strings.count = 0;
+}
+
+// The size the object was allocated with.
+size_t objectSize(Obj *object) {
+	switch(object->type) {
+		case OBJ_ARRAY:			return sizeof(ObjArray);
+		case OBJ_BOUND_METHOD:	return sizeof(ObjBoundMethod);
+		case OBJ_CLASS:			return sizeof(ObjClass);
+		case OBJ_CLOSURE:		return sizeof(ObjClosure);
+		case OBJ_FUNCTION: {
+			ObjFunction *f = (ObjFunction*)object;
+			return sizeof(ObjFunction) + f->uvCount * sizeof(uint16_t) + (f->maxArity - f->minArity + 1) * sizeof(size_t);
+		}
+		case OBJ_INSTANCE:		return sizeof(ObjInstance);
+		case OBJ_MODULE:		return sizeof(ObjModule);
+		case OBJ_NATIVE:		return sizeof(ObjNative);
+		case OBJ_STRING:		return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+		case OBJ_TABLE:			return tableObjectSize;
+		case OBJ_UPVALUE:		return sizeof(ObjUpvalue);
+		case OBJ_THREAD:		return sizeof(thread);
+		case OBJ_EXCEPTION:		return sizeof(ObjException);
+		case OBJ_ROPE:			return sizeof(ObjRope);
 	}
+	return 0;
 }
 
 static void freeObject(GarbageCollector *gc, Obj *object) {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %s\n", (void*)object, ObjTypeNames[object->type]);
 #endif /* DEBUG_LOG_GC */
+	if((object->type != OBJ_CLASS) || !((ObjClass*)object)->cname) {	// Classes in static memory weren't allocated.
+		TypeStats *stats = &gc->types[object->type];
+		stats->freed++;
+		stats->bytesFreed += objectSize(object);
+	}
+	if(gc->profile)
+		profileFree(gc->profile, object);
 	switch(object->type) {
 		case OBJ_ARRAY: {
 			ObjArray *array = (ObjArray*)object;
-			FREE_ARRAY(gc, Value, array->values, array->capacity);
+			FREE_SLOTS(gc, array->values, array->capacity);
 			FREE(gc, ObjArray, object);
 			break;
 		}
@@ -243,7 +361,7 @@ static void freeObject(GarbageCollector *gc, Obj *object) {
 		case OBJ_FUNCTION: {
 			ObjFunction *f = (ObjFunction*)object;
 			freeChunk(gc, &f->chunk);
-			_free(gc, object, sizeof(ObjFunction) + f->uvCount * sizeof(uint16_t) + (f->maxArity - f->minArity + 1) * sizeof(size_t));
+			_free(gc, object, objectSize(object));
 			break;
 		}
 		case OBJ_INSTANCE: {
@@ -257,20 +375,23 @@ static void freeObject(GarbageCollector *gc, Obj *object) {
 		case OBJ_NATIVE:
 			FREE(gc, ObjNative, object);
 			break;
-		case OBJ_STRING: {
-			ObjString *string = (ObjString*)object;
-			FREE_ARRAY(gc, char, string->chars, string->length + 1);
-			FREE(gc, ObjString, object);
+		case OBJ_STRING:
+			if(gc->strings && ((ObjString*)object)->interned)
+				tableDelete(gc->strings, OBJ_VAL(object));	// The intern table only lets go of a string once it is freed.
+			_free(gc, object, objectSize(object));
 			break;
-		}
 		case OBJ_TABLE:
 			freeTable(gc, (ObjTable*)object);
 			break;
 		case OBJ_UPVALUE:
 			FREE(gc, ObjUpvalue, object);
 			break;
+		case OBJ_ROPE:
+			FREE(gc, ObjRope, object);
+			break;
 		case OBJ_THREAD: {
 			thread *t = (thread*)object;
+			unpinObject(object);
 			FREE_ARRAY(gc, Value, t->stack, t->stackLast - t->stack + 1);
 			FREE(gc, thread, object);
 			break;
@@ -283,95 +404,839 @@ static void freeObject(GarbageCollector *gc, Obj *object) {
 
 void freeChunk(GarbageCollector *gc, Chunk *chunk) {
 	FREE_ARRAY(gc, uint32_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(gc, size_t, chunk->lines, chunk->capacity);
+	FREE_ARRAY(gc, uint8_t, chunk->lineInfo, chunk->lineInfoCapacity);
 	chunk->constants = NULL;
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
-	chunk->lines = NULL;
+	chunk->lineInfo = NULL;
+	chunk->lineInfoCount = 0;
+	chunk->lineInfoCapacity = 0;
 	chunk->constants = NULL;
 }
 
-static void sweep(GarbageCollector *gc, bool nextGCisMajor) {
-	Obj **o = &gc->objects;
-	if(nextGCisMajor) {
-		while(*o) {
-			if((*o)->isBlack) {
-				(*o)->isBlack = false;
-				o = &(*o)->next;
-			} else {
-				Obj *unreached = *o;
-				*o = (*o)->next;
-				freeObject(gc, unreached);
-			}
+// Frees a young object that wasn't reached, or promotes it.  Survivors stay black, so minor collections don't trace them again.
+static void sweepYoungObject(GarbageCollector *gc, Obj *o) {
+	if(isBlack(gc, o)) {
+		if(o->inArena) {
+			ArenaPage *page = pageOf(o);
+			size_t i = cellIndex(page, o);
+			page->old[i / 64] |= (uint64_t)1 << (i % 64);
+		} else {
+			pushObject(&gc->objects, o);
 		}
 	} else {
-		while(*o) {
-			if((*o)->isBlack) {
-				o = &(*o)->next;
-			} else {
-				Obj *unreached = *o;
-				*o = (*o)->next;
-				freeObject(gc, unreached);
+		freeObject(gc, o);
+	}
+}
+
+static void sweepYoung(GarbageCollector *gc) {
+	for(size_t i = 0; i < gc->young.count; i++)
+		sweepYoungObject(gc, gc->young.items[i]);
+	gc->young.count = 0;
+}
+
+// Frees the old objects in a page that weren't reached, reading only the page's bitmaps.  Returns how many were freed.
+static size_t sweepPage(GarbageCollector *gc, ArenaPage *page) {
+	size_t freed = 0;
+	for(size_t w = 0; w < ARENA_BITMAP_WORDS; w++) {
+		uint64_t dead = page->old[w] & (gc->blackMark ? ~page->marks[w] : page->marks[w]);
+		while(dead) {
+			size_t bit = __builtin_ctzll(dead);
+			dead &= dead - 1;
+			freeObject(gc, cellAt(page, w * 64 + bit));
+			freed++;
+		}
+	}
+	page->unswept = false;
+	arenaTrim(&gc->arena, page);
+	return freed;
+}
+
+static ArenaPage *nextUnswept(Arena *a, size_t c) {
+	ArenaPage *page = a->unswept[c];
+	if(page)
+		a->unswept[c] = page->sweepNext;
+	return page;
+}
+
+// Every page that could hold an old object waits to be swept, either by a step or by the allocator needing room.
+static void queuePages(Arena *a) {
+	for(ArenaPage *page = a->pages; page; page = page->allNext) {
+		if(!isObjectPage(page))
+			continue;
+		size_t c = page->list - ARENA_CLASSES;
+		page->unswept = true;
+		page->sweepNext = a->unswept[c];
+		a->unswept[c] = page;
+	}
+}
+
+// Stack writes don't go through writeBarrier, so threads are always in the remembered set.
+static void rememberThreads(VM *vm) {
+	if(vm->baseThread)
+		writeBarrier(vm, vm->baseThread);
+}
+
+static void minorCollection(VM *vm) {
+	GarbageCollector *gc = &vm->gc;
+	markRoots(vm);
+	traceReferences(&gc->gray);
+	clearWeakTables(&gc->gray);
+	sweepYoung(gc);
+	rememberThreads(vm);
+}
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+typedef struct {
+	uint64_t deadline;
+	size_t work;
+	size_t quota;
+	size_t minimum;	// Done even past the deadline, so that marking keeps ahead of the program.
+} Step;
+
+// A unit of work is one object blackened or swept.  The clock is only read every GC_STEP_BATCH units.
+static bool stepDone(Step *s) {
+	s->work++;
+	if(s->work >= s->quota)
+		return true;
+	return (s->work >= s->minimum) && ((s->work % GC_STEP_BATCH) == 0) && (now() >= s->deadline);
+}
+
+static void drainOverwrites(GarbageCollector *gc) {
+	for(size_t i = 0; i < gc->satbCount; i++)
+		markObject(&gc->gray, gc->satb[i]);
+	gc->satbCount = 0;
+}
+
+static void* acquireMemory(GarbageCollector *gc, size_t size, bool object) {
+	if(size <= ARENA_MAX_SIZE) {
+		if(object) {
+			// Sweeping a page of this size can make room, rather than growing the heap.
+			size_t c = arenaSizeClass(size);
+			size_t before = gc->bytesAllocated;
+			while((gc->arena.available[c + ARENA_CLASSES] == NULL) && gc->arena.unswept[c])
+				sweepPage(gc, nextUnswept(&gc->arena, c));
+			gc->nextMinorGC -= before - gc->bytesAllocated;	// Old garbage freed here doesn't make room in the nursery.
+		}
+		return arenaAlloc(&gc->arena, size, object);
+	}
+	if(size >= ARENA_LARGE_SIZE)
+		return largeAlloc(size);
+	return malloc(size);
+}
+
+static void releaseMemory(GarbageCollector *gc, void *p, size_t size) {
+	if(size <= ARENA_MAX_SIZE)
+		arenaFree(&gc->arena, p, size);
+	else if(size >= ARENA_LARGE_SIZE)
+		largeFree(p);
+	else
+		free(p);
+}
+
+// While the workers are marking, freed memory isn't reused, since they might still be reading it.
+static void deferFree(GarbageCollector *gc, void *p, size_t size) {
+	if(p == NULL)
+		return;
+	if(!gc->concurrent) {
+		releaseMemory(gc, p, size);
+		return;
+	}
+	if(gc->deferredCapacity < gc->deferredCount + 1) {
+		gc->deferredCapacity = GROW_CAPACITY(gc->deferredCapacity);
+		gc->deferred = realloc(gc->deferred, sizeof(DeferredFree) * gc->deferredCapacity);
+	}
+	gc->deferred[gc->deferredCount++] = (DeferredFree){p, size};
+}
+
+static void freeDeferred(GarbageCollector *gc) {
+	for(size_t i = 0; i < gc->deferredCount; i++)
+		releaseMemory(gc, gc->deferred[i].pointer, gc->deferred[i].size);
+	gc->deferredCount = 0;
+}
+
+// Moves the top n objects of one gray stack to another.
+static void moveGray(GrayStack *from, GrayStack *to, size_t n) {
+	for(size_t i = from->count - n; i < from->count; i++)
+		pushGrayStack(to, from->items[i]);
+	from->count -= n;
+}
+
+// Blackens a worker's objects, giving half of them to the pool whenever another worker has run out.
+static void traceShared(GarbageCollector *gc, GrayStack *s) {
+	size_t work = 0;
+	while(s->count > 0) {
+		blackenObject(s, s->items[--s->count]);
+		if((++work % GC_STEP_BATCH == 0) && (s->count > 1) && __atomic_load_n(&gc->hungryWorkers, __ATOMIC_RELAXED)) {
+			pthread_mutex_lock(&gc->lock);
+			moveGray(s, &gc->pool, s->count / 2);
+			pthread_cond_broadcast(&gc->wake);
+			pthread_mutex_unlock(&gc->lock);
+		}
+	}
+}
+
+// Marking ends when every worker is idle with the pool empty.  Since idle workers have nothing on their own stacks, nothing is left gray.
+static void* runWorker(void *arg) {
+	GrayStack *s = arg;
+	GarbageCollector *gc = s->gc;
+	pthread_mutex_lock(&gc->lock);
+	while(true) {
+		while(gc->markerState == MARKER_IDLE)
+			pthread_cond_wait(&gc->wake, &gc->lock);
+		if(gc->markerState == MARKER_EXIT)
+			break;
+		if(gc->pool.count > 0) {
+			moveGray(&gc->pool, s, (gc->pool.count + gc->workerCount - 1) / gc->workerCount);
+			pthread_mutex_unlock(&gc->lock);
+			traceShared(gc, s);
+			pthread_mutex_lock(&gc->lock);
+			continue;
+		}
+		if(++gc->idleWorkers == gc->workerCount) {
+			gc->markerState = MARKER_IDLE;
+			pthread_cond_broadcast(&gc->wake);
+			pthread_cond_signal(&gc->done);
+		} else {
+			__atomic_add_fetch(&gc->hungryWorkers, 1, __ATOMIC_RELAXED);
+			pthread_cond_wait(&gc->wake, &gc->lock);
+			__atomic_sub_fetch(&gc->hungryWorkers, 1, __ATOMIC_RELAXED);
+		}
+		gc->idleWorkers--;
+	}
+	pthread_mutex_unlock(&gc->lock);
+	return NULL;
+}
+
+void initMarker(GarbageCollector *gc, unsigned int threads) {
+	pthread_mutex_init(&gc->lock, NULL);
+	pthread_cond_init(&gc->wake, NULL);
+	pthread_cond_init(&gc->done, NULL);
+	gc->markerState = MARKER_IDLE;
+	gc->pool = (GrayStack){gc, NULL, 0, 0, false, {NULL, 0, 0}, {NULL, 0, 0}};
+	gc->workers = malloc(sizeof(GCWorker) * threads);
+	for(unsigned int i = 0; i < threads; i++) {
+		GCWorker *w = &gc->workers[gc->workerCount];
+		w->gray = (GrayStack){gc, NULL, 0, 0, true, {NULL, 0, 0}, {NULL, 0, 0}};	// The program allocates into the same mark bitmaps.
+		if(pthread_create(&w->thread, NULL, runWorker, &w->gray) != 0)
+			break;
+		gc->workerCount++;
+	}
+}
+
+// Hands the gray stack to the workers.
+static void resumeMarker(GarbageCollector *gc) {
+	pthread_mutex_lock(&gc->lock);
+	moveGray(&gc->gray, &gc->pool, gc->gray.count);
+	gc->markerState = MARKER_RUNNING;
+	pthread_cond_broadcast(&gc->wake);
+	pthread_mutex_unlock(&gc->lock);
+}
+
+static void waitForMarker(GarbageCollector *gc) {
+	pthread_mutex_lock(&gc->lock);
+	while(gc->markerState == MARKER_RUNNING)
+		pthread_cond_wait(&gc->done, &gc->lock);
+	pthread_mutex_unlock(&gc->lock);
+}
+
+static void startConcurrentMark(VM *vm) {
+	GarbageCollector *gc = &vm->gc;
+	if(vm->baseThread)
+		scanThread(&gc->gray, vm->baseThread);
+	markRoots(vm);
+	gc->concurrent = true;
+	resumeMarker(gc);
+}
+
+// Returns true once the workers have run out of work, and the program should stop for the final mark.
+static bool concurrentMarkDone(GarbageCollector *gc) {
+	pthread_mutex_lock(&gc->lock);
+	bool running = gc->markerState == MARKER_RUNNING;
+	pthread_mutex_unlock(&gc->lock);
+	if(running) {
+		if(gc->bytesAllocated <= gc->nextMajorGC * GC_HEAP_GROW_FACTOR)
+			return false;
+		// The program is allocating faster than the heap is being marked, so it waits rather than letting the heap grow without bound.
+		waitForMarker(gc);
+	} else if(gc->satbCount > GC_STEP_WORK) {
+		// Tracing a long log would make the final mark a long pause, so the workers take another pass.
+		drainOverwrites(gc);
+		resumeMarker(gc);
+		return false;
+	}
+	gc->concurrent = false;
+	freeDeferred(gc);
+	drainOverwrites(gc);
+	return true;
+}
+
+static void finishMark(VM *vm) {
+	GarbageCollector *gc = &vm->gc;
+	// The program has been running since the roots were marked, so they get marked again before the cycle can finish.
+	markRoots(vm);
+	if(vm->baseThread)
+		markThread(&gc->gray, vm->baseThread);
+	if(gc->workerCount > 1) {
+		resumeMarker(gc);
+		waitForMarker(gc);
+	} else {
+		traceReferences(&gc->gray);
+	}
+	for(unsigned int i = 0; i < gc->workerCount; i++) {
+		ObjVector *weak = &gc->workers[i].gray.weak;
+		for(size_t j = 0; j < weak->count; j++)
+			pushObject(&gc->gray.weak, weak->items[j]);
+		weak->count = 0;
+		ObjVector *strings = &gc->workers[i].gray.strings;
+		for(size_t j = 0; j < strings->count; j++)
+			pushObject(&gc->gray.strings, strings->items[j]);
+		strings->count = 0;
+	}
+	clearWeakTables(&gc->gray);
+	ObjVector dying = gc->dying;	// Empty, but keeps its buffer for the nursery.
+	gc->dying = gc->young;
+	gc->young = dying;
+	gc->sweep = 0;
+	gc->survivors = 0;
+	queuePages(&gc->arena);
+	rememberThreads(vm);
+}
+
+static bool markStep(VM *vm, Step *s) {
+	GarbageCollector *gc = &vm->gc;
+	if(gc->workerCount > 0) {
+		if(!concurrentMarkDone(gc))
+			return false;
+	} else {
+		while(gc->gray.count > 0) {
+			blackenObject(&gc->gray, gc->gray.items[--gc->gray.count]);
+			if(stepDone(s))
+				return false;
+		}
+	}
+	finishMark(vm);
+	return true;
+}
+
+static bool sweepStep(GarbageCollector *gc, Step *s) {
+	while(gc->dying.count > 0) {
+		sweepYoungObject(gc, gc->dying.items[--gc->dying.count]);
+		if(stepDone(s))
+			return false;
+	}
+	// Objects promoted while this runs are added at the end, and are kept.
+	while(gc->sweep < gc->objects.count) {
+		Obj *o = gc->objects.items[gc->sweep++];
+		if(isBlack(gc, o))
+			gc->objects.items[gc->survivors++] = o;
+		else
+			freeObject(gc, o);
+		if(stepDone(s))
+			return false;
+	}
+	gc->objects.count = gc->survivors;
+	gc->sweep = gc->survivors;	// A later step may find objects promoted after this.
+	for(size_t c = 0; c < ARENA_CLASSES; c++) {
+		ArenaPage *page;
+		while((page = nextUnswept(&gc->arena, c))) {
+			// A page is a batch of its own, so check the clock after each one.
+			s->work += sweepPage(gc, page);
+			if(stepDone(s) || (now() >= s->deadline))
+				return false;
+		}
+	}
+	return true;
+}
+
+// Does a slice of a major cycle.  Returns true when the cycle is finished.
+static bool majorStep(VM *vm) {
+	GarbageCollector *gc = &vm->gc;
+	// There are no minor collections while marking, and young objects are traced too.  So however small the budget, a step
+	// does a unit of work for each object allocated since the last one, and a batch more, or marking might never finish.
+	size_t allocated = ((gc->phase == GC_MARK) && (gc->young.count > gc->youngAfterStep)) ? gc->young.count - gc->youngAfterStep : 0;
+	size_t minimum = allocated + GC_STEP_BATCH;
+	Step s = {now() + gc->pauseBudget, 0, GC_STEP_WORK + gc->debt, minimum};
+	if(s.quota < minimum)
+		s.quota = minimum;
+	bool finished = false;
+	switch(gc->phase) {
+		case GC_IDLE:
+			// With the nursery empty, every object is black, so flipping blackMark makes them all white.
+			minorCollection(vm);
+			gc->blackMark = !gc->blackMark;
+			gc->cardEpoch++;
+			// The remembered set is only needed when the old generation isn't traced.
+			gc->gray.count = 0;
+			gc->stepCount = 0;
+			gc->phase = GC_MARK;
+			if(gc->workerCount > 0) {
+				startConcurrentMark(vm);
+				break;
 			}
+			markRoots(vm);
+			// Fall through.
+		case GC_MARK:
+			if(!markStep(vm, &s))
+				break;
+			gc->phase = GC_SWEEP;
+			// Fall through.
+		case GC_SWEEP:
+			if(!sweepStep(gc, &s))
+				break;
+			gc->phase = GC_IDLE;
+			finished = true;
+	}
+	gc->debt = (finished || (s.work >= s.quota)) ? 0 : s.quota - s.work;
+	gc->youngAfterStep = gc->young.count;
+	return finished;
+}
+
+// Pauses below 8ns get a bucket each.  Above that, each power of 2 is split into 8 buckets.
+static size_t pauseBucket(uint64_t pause) {
+	if(pause < 8)
+		return pause;
+	size_t e = 3;
+	while(pause >> (e + 1))
+		e++;
+	return (e - 2) * 8 + ((pause >> (e - 3)) & 7);
+}
+
+static uint64_t bucketStart(size_t bucket) {
+	if(bucket < 8)
+		return bucket;
+	return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+static void recordPause(GarbageCollector *gc, uint64_t start) {
+	uint64_t pause = now() - start;
+	gc->pauses[pauseBucket(pause)]++;
+	gc->pauseCount++;
+	gc->pauseTotal += pause;
+	if(pause > gc->pauseMax)
+		gc->pauseMax = pause;
+}
+
+// C code that holds a pointer to an object across a call back into the interpreter pins it, since compacting could move it.
+void pinObject(Obj *o) {
+	if(o->inArena)
+		pageOf(o)->pins++;
+}
+
+void unpinObject(Obj *o) {
+	if(o->inArena) {
+		assert(pageOf(o)->pins > 0);
+		pageOf(o)->pins--;
+	}
+}
+
+static bool fragmented(Arena *a) {
+	size_t pages = 0;
+	double occupied = 0;
+	for(ArenaPage *page = a->pages; page; page = page->allNext) {
+		if(isObjectPage(page)) {
+			pages++;
+			occupied += (double)page->live / arenaCapacity(page);
+		}
+	}
+	return (pages >= GC_COMPACT_MIN_PAGES) && (occupied < pages * GC_COMPACT_OCCUPANCY);
+}
+
+// Updates the references in a live object to the objects that have moved.  Only references the marker follows are live.
+static void forwardFields(Obj *o) {
+	switch(o->type) {
+		case OBJ_ARRAY: {
+			ObjArray *array = (ObjArray*)o;
+			FORWARD(array->klass);
+			FORWARD(array->fields);
+			for(size_t i = 0; i < array->count; i++)
+				forwardValue(&array->values[i]);
+			break;
+		}
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod *bound = (ObjBoundMethod*)o;
+			forwardValue(&bound->receiver);
+			FORWARD(bound->method);
+			break;
+		}
+		case OBJ_CLASS: {
+			ObjClass *klass = (ObjClass*)o;
+			FORWARD(klass->name);
+			FORWARD(klass->methods);
+			FORWARD(klass->newFn);	// Also in methods.
+			break;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure *cl = (ObjClosure*)o;
+			FORWARD(cl->f);
+			for(size_t i = 0; i < cl->uvCount; i++)
+				FORWARD(cl->upvalues[i]);
+			break;
 		}
+		case OBJ_FUNCTION: {
+			ObjFunction *f = (ObjFunction*)o;
+			FORWARD(f->name);
+			FORWARD(f->chunk.constants);
+			FORWARD(f->chunk.constantIndices);
+			break;
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance *instance = (ObjInstance*)o;
+			FORWARD(instance->klass);
+			FORWARD(instance->fields);
+			break;
+		}
+		case OBJ_MODULE: {
+			ObjModule *module = (ObjModule*)o;
+			FORWARD(module->name);
+			FORWARD(module->fields);
+			FORWARD(module->klass);
+			break;
+		}
+		case OBJ_TABLE:
+			forwardTable((ObjTable*)o);
+			break;
+		case OBJ_UPVALUE: {
+			ObjUpvalue *uv = (ObjUpvalue*)o;
+			forwardValue(&uv->closed);
+			if(uv->location != &uv->closed)
+				FORWARD(uv->next);	// Closed upvalues may still point at one that has been freed.
+			break;
+		}
+		case OBJ_EXCEPTION: {
+			ObjException *e = (ObjException*)o;
+			FORWARD(e->klass);
+			FORWARD(e->fields);
+			forwardValue(&e->msg);
+			break;
+		}
+		case OBJ_STRING: {
+			ObjString *string = (ObjString*)o;
+			FORWARD(string->klass);
+			FORWARD(string->fields);
+			break;
+		}
+		case OBJ_ROPE: {
+			ObjRope *rope = (ObjRope*)o;
+			FORWARD(rope->left);
+			FORWARD(rope->right);
+			break;
+		}
+		case OBJ_THREAD: {
+			thread *t = (thread*)o;
+			// The slots holding return addresses never look like objects.
+			for(Value *slot = t->stack; slot < t->stackTop; slot++)
+				forwardValue(slot);
+			forwardValue(&t->exception);
+			FORWARD(t->openUpvalues);
+			for(Compiler *c = t->currentCompiler; c != NULL; c = c->enclosing) {
+				FORWARD(c->name);
+				FORWARD(c->chunk.constants);
+				FORWARD(c->chunk.constantIndices);
+			}
+			for(ClassCompiler *c = t->currentClassCompiler; c != NULL; c = c->enclosing)
+				FORWARD(c->methods);
+			break;
+		}
+		case OBJ_NATIVE:
+			break;
 	}
 }
 
-void collectGarbage(VM *vm) {
+// Copies an object out of an evacuating page, and leaves its new address behind.
+static void moveObject(GarbageCollector *gc, ArenaPage *page, Obj *from) {
+	Obj *to = arenaAlloc(&gc->arena, page->cellSize, true);
+	memcpy(to, from, page->cellSize);
+	ArenaPage *toPage = pageOf(to);
+	size_t i = cellIndex(toPage, to);
+	toPage->old[i / 64] |= (uint64_t)1 << (i % 64);
+	setMark(to, gc->blackMark);
+	// Pointers into the object itself move with it.
+	if(from->type == OBJ_UPVALUE) {
+		if(((ObjUpvalue*)from)->location == &((ObjUpvalue*)from)->closed)
+			((ObjUpvalue*)to)->location = &((ObjUpvalue*)to)->closed;
+	} else if(from->type == OBJ_FUNCTION) {
+		ObjFunction *f = (ObjFunction*)to;
+		f->code_offsets = (size_t*)&f->uv[f->uvCount];
+	}
+	((Obj**)from)[1] = to;
+	if(gc->profile)
+		profileMove(gc->profile, from, to);
+}
+
+static int compareLive(const void *a, const void *b) {
+	size_t x = (*(ArenaPage* const*)a)->live;
+	size_t y = (*(ArenaPage* const*)b)->live;
+	return (x > y) - (x < y);
+}
+
+// Picks the emptiest pages of each class, so that the other pages have room for their objects.  Returns them linked through sweepNext.
+static ArenaPage *choosePages(Arena *a) {
+	ArenaPage *chosen = NULL;
+	ArenaPage **candidates = malloc(sizeof(ArenaPage*) * a->pageCount);
+	for(size_t list = ARENA_CLASSES; list < ARENA_LISTS; list++) {
+		size_t pages = 0;
+		size_t live = 0;
+		size_t capacity = 0;
+		size_t count = 0;
+		for(ArenaPage *page = a->pages; page; page = page->allNext) {
+			if(page->list != list)
+				continue;
+			pages++;
+			live += page->live;
+			capacity = arenaCapacity(page);
+			if(page->pins == 0)
+				candidates[count++] = page;
+		}
+		size_t needed = (live + capacity - 1) / (capacity ? capacity : 1);
+		if(pages <= needed)
+			continue;
+		qsort(candidates, count, sizeof(ArenaPage*), compareLive);
+		for(size_t i = 0; (i < count) && (i < pages - needed); i++) {
+			arenaEvacuate(a, candidates[i]);
+			candidates[i]->sweepNext = chosen;
+			chosen = candidates[i];
+		}
+	}
+	free(candidates);
+	return chosen;
+}
+
+// Slides the old generation into fewer pages.  Objects move, so this only runs where the interpreter holds no pointers to them.
+void compactHeap(VM *vm) {
+	GarbageCollector *gc = &vm->gc;
+	gc->compactPending = false;
+	if(gc->phase != GC_IDLE)
+		return;	// Reconsidered at the end of this cycle.
+	uint64_t start = now();
+	minorCollection(vm);	// Afterwards, every object in the arena is old.
+	gc->nextMinorGC = gc->bytesAllocated + GC_NURSERY_SIZE;
+	assert(gc->young.count == 0);
+
+	Arena *a = &gc->arena;
+	ArenaPage *evacuated = choosePages(a);
+	for(ArenaPage *page = evacuated; page; page = page->sweepNext) {
+		for(size_t w = 0; w < ARENA_BITMAP_WORDS; w++) {
+			for(uint64_t old = page->old[w]; old; old &= old - 1)
+				moveObject(gc, page, cellAt(page, w * 64 + __builtin_ctzll(old)));
+		}
+	}
+
+	FORWARD(vm->strings);
+	FORWARD(gc->strings);
+	FORWARD(vm->globals);
+	FORWARD(vm->builtinMods);
+	FORWARD(vm->initString);
+	FORWARD(vm->newString);
+	for(int c = 0; c < 256; c++)
+		FORWARD(vm->characters[c]);
+	FORWARD(vm->baseThread);
+	for(size_t i = 0; i < gc->gray.count; i++)
+		FORWARD(gc->gray.items[i]);
+	for(size_t i = 0; i < gc->objects.count; i++)
+		forwardFields(gc->objects.items[i]);
+	for(ArenaPage *page = a->pages; page; page = page->allNext) {
+		if(!isObjectPage(page) || page->evacuating)
+			continue;
+		for(size_t w = 0; w < ARENA_BITMAP_WORDS; w++) {
+			for(uint64_t old = page->old[w]; old; old &= old - 1)
+				forwardFields(cellAt(page, w * 64 + __builtin_ctzll(old)));
+		}
+	}
+
+	while(evacuated) {
+		ArenaPage *next = evacuated->sweepNext;
+		arenaReleaseEvacuated(a, evacuated);
+		evacuated = next;
+	}
+	gc->compactions++;
+	recordPause(gc, start);
 #ifdef DEBUG_LOG_GC
-	printf("-- gc begin\n");
-	size_t before = vm->gc.bytesAllocated;
+	printf("-- compacted to %zu pages\n", a->pageCount);
 #endif /* DEBUG_LOG_GC */
+}
 
-	markRoots(vm);
-	traceReferences(&vm->gc);
-	if(vm->strings)
-		tableRemoveWhite(vm->strings);
-	bool nextGCisMajor = vm->gc.bytesAllocated > vm->gc.nextMajorGC;
-	sweep(&vm->gc, nextGCisMajor);
-	vm->gc.nextMinorGC = vm->gc.bytesAllocated * GC_MINOR_HEAP_GROW_FACTOR;
-	if(vm->gc.nextGCisMajor)
-		vm->gc.nextMajorGC = vm->gc.bytesAllocated * GC_HEAP_GROW_FACTOR;
-	vm->gc.nextGCisMajor = nextGCisMajor;
+static void collectGarbage(VM *vm) {
+	GarbageCollector *gc = &vm->gc;
+	uint64_t start = now();
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin (%s)\n", (gc->phase != GC_IDLE || gc->nextGCisMajor) ? "major step" : "minor");
+	size_t before = gc->bytesAllocated;
+#endif /* DEBUG_LOG_GC */
+
+	if((gc->phase == GC_IDLE) && !gc->nextGCisMajor) {
+		minorCollection(vm);
+		gc->minorCollections++;
+	} else if((gc->phase == GC_SWEEP) && (++gc->stepCount % (GC_NURSERY_SIZE / GC_STEP_SIZE) == 0)) {
+		// Old objects have their final color during the sweep, so the nursery can be emptied as it fills up.
+		minorCollection(vm);
+		gc->minorCollections++;
+	} else if(majorStep(vm)) {
+		gc->majorCycles++;
+		gc->nextMajorGC = gc->bytesAllocated * GC_HEAP_GROW_FACTOR;
+		gc->compactPending = gc->compact && fragmented(&gc->arena);
+#ifdef DEBUG_STRESS_GC
+		gc->compactPending = gc->compact;	// Move objects as often as possible.
+#endif /* DEBUG_STRESS_GC */
+	}
+
+	if(gc->phase == GC_IDLE) {
+		gc->nextGCisMajor = gc->bytesAllocated > gc->nextMajorGC;
+		gc->nextMinorGC = gc->bytesAllocated + GC_NURSERY_SIZE;
+	} else {
+		gc->nextMinorGC = gc->bytesAllocated + GC_STEP_SIZE;
+	}
+	recordPause(gc, start);
 
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
 	printf("   collected %zu bytes (from %zu to %zu next at %zu\n",
-			before - vm->gc.bytesAllocated, before, vm->gc.bytesAllocated, vm->gc.nextMinorGC);
+			before - gc->bytesAllocated, before, gc->bytesAllocated, gc->nextMinorGC);
 #endif /* DEBUG_LOG_GC */
 }
 
+void collectStep(VM *vm) {
+	collectGarbage(vm);
+}
+
+void collectAll(VM *vm) {
+	GarbageCollector *gc = &vm->gc;
+	// Garbage made before a cycle in progress started might have been marked already, so that cycle is finished and another run.
+	for(int cycles = (gc->phase == GC_IDLE) ? 1 : 2; cycles > 0; cycles--) {
+		gc->nextGCisMajor = true;
+		do {
+			if(gc->concurrent)
+				waitForMarker(gc);	// Rather than polling the workers until they are done.
+			collectGarbage(vm);
+		} while(gc->phase != GC_IDLE);
+	}
+}
+
+double pauseBucketStart(size_t bucket) {
+	return bucketStart(bucket) / 1e6;
+}
+
+// Returns the end of the bucket that the pth percentile falls in.
+double pausePercentile(GarbageCollector *gc, double p) {
+	size_t rank = (size_t)(p / 100 * gc->pauseCount);
+	size_t seen = 0;
+	for(size_t i = 0; i < GC_PAUSE_BUCKETS - 1; i++) {
+		seen += gc->pauses[i];
+		if(seen > rank)
+			return bucketStart(i + 1) / 1e6;
+	}
+	return gc->pauseMax / 1e6;
+}
+
+void printGCStats(VM *vm) {
+	GarbageCollector *gc = &vm->gc;
+	if(gc->pauseCount == 0) {
+		fprintf(stderr, "GC: no pauses.\n");
+		return;
+	}
+	fprintf(stderr, "GC: %zu pauses, budget %.3f ms, total %.3f ms\n", gc->pauseCount, gc->pauseBudget / 1e6, gc->pauseTotal / 1e6);
+	fprintf(stderr, "GC pause ms: p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+			pausePercentile(gc, 50), pausePercentile(gc, 90), pausePercentile(gc, 99), pausePercentile(gc, 99.9), gc->pauseMax / 1e6);
+	fprintf(stderr, "GC: %zu arena pages, %zu compactions\n", gc->arena.pageCount, gc->compactions);
+}
+
+static void freeVector(GarbageCollector *gc, ObjVector *v) {
+	for(size_t i = 0; i < v->count; i++)
+		freeObject(gc, v->items[i]);
+	free(v->items);
+	*v = (ObjVector){NULL, 0, 0};
+}
+
 void freeObjects(GarbageCollector *gc) {
-	Obj *object = gc->objects;
-	while(object) {
-		Obj *next = object->next;
-		freeObject(gc, object);
-		object = next;
+	if(gc->workers) {
+		waitForMarker(gc);
+		pthread_mutex_lock(&gc->lock);
+		gc->markerState = MARKER_EXIT;
+		pthread_cond_broadcast(&gc->wake);
+		pthread_mutex_unlock(&gc->lock);
+		for(unsigned int i = 0; i < gc->workerCount; i++) {
+			pthread_join(gc->workers[i].thread, NULL);
+			free(gc->workers[i].gray.items);
+			free(gc->workers[i].gray.weak.items);
+			free(gc->workers[i].gray.strings.items);
+		}
+		free(gc->workers);
+		free(gc->pool.items);
+		pthread_cond_destroy(&gc->done);
+		pthread_cond_destroy(&gc->wake);
+		pthread_mutex_destroy(&gc->lock);
+		gc->workers = NULL;
+		gc->workerCount = 0;
+		gc->concurrent = false;
+	}
+	freeDeferred(gc);
+	free(gc->deferred);
+	free(gc->satb);
+	freeVector(gc, &gc->young);
+	freeVector(gc, &gc->dying);
+	if(gc->phase == GC_SWEEP) {
+		// Objects between the survivors and sweep have already been freed.
+		memmove(&gc->objects.items[gc->survivors], &gc->objects.items[gc->sweep], sizeof(Obj*) * (gc->objects.count - gc->sweep));
+		gc->objects.count -= gc->sweep - gc->survivors;
 	}
-	free(gc->grayStack);
+	freeVector(gc, &gc->objects);
+	for(ArenaPage *page = gc->arena.pages; page; page = page->allNext)
+		page->unswept = true;
+	for(ArenaPage *page = gc->arena.pages; page; page = page->allNext) {
+		for(size_t w = 0; w < ARENA_BITMAP_WORDS; w++) {
+			for(uint64_t old = page->old[w]; old; old &= old - 1)
+				freeObject(gc, cellAt(page, w * 64 + __builtin_ctzll(old)));
+		}
+	}
+	free(gc->gray.items);
+	free(gc->gray.weak.items);
+	free(gc->gray.strings.items);
+	freeArena(&gc->arena);
 }
 
-void* reallocate(VM *vm, void* previous, size_t oldSize, size_t newSize) {
+static void countAllocation(VM *vm, size_t oldSize, size_t newSize) {
 	GarbageCollector *gc = &vm->gc;
 	assert(gc->bytesAllocated  + newSize >= oldSize);	// We won't drop bytes allocated below 0.
 	gc->bytesAllocated += newSize - oldSize;
 
 	if(newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
+		gc->nextGCisMajor = (++gc->stressCount & 0xf) == 0;
 		collectGarbage(vm);
 #endif /* DEBUG_STRESS_GC */
-		if(gc->bytesAllocated > gc->nextMajorGC) {
+		if(gc->bytesAllocated > gc->nextMinorGC) {
 			collectGarbage(vm);
 		}
 	}
+}
+
+void* reallocate(VM *vm, void* previous, size_t oldSize, size_t newSize) {
+	GarbageCollector *gc = &vm->gc;
+	countAllocation(vm, oldSize, newSize);
 
 	if(newSize == 0) {
-		free(previous);
+		deferFree(gc, previous, oldSize);
 		return NULL;
 	}
+	if(previous == NULL)
+		return acquireMemory(gc, newSize, false);
+	if((oldSize <= ARENA_MAX_SIZE) && (newSize <= ARENA_MAX_SIZE) && (arenaSizeClass(oldSize) == arenaSizeClass(newSize)))
+		return previous;	// Same size class.
+	if((oldSize >= ARENA_LARGE_SIZE) && (newSize >= ARENA_LARGE_SIZE) && largeResize(previous, newSize))
+		return previous;	// It didn't move, so the workers can keep reading it.
+	if((oldSize > ARENA_MAX_SIZE) && (newSize > ARENA_MAX_SIZE) && (oldSize < ARENA_LARGE_SIZE) && (newSize < ARENA_LARGE_SIZE) && !gc->concurrent)
+		return realloc(previous, newSize);
 
-	return realloc(previous, newSize);
+	void *p = acquireMemory(gc, newSize, false);
+	memcpy(p, previous, oldSize < newSize ? oldSize : newSize);
+	deferFree(gc, previous, oldSize);
+	return p;
 }
 
 void _free(GarbageCollector *gc, void* previous, size_t oldSize) {
@@ -381,16 +1246,19 @@ void _free(GarbageCollector *gc, void* previous, size_t oldSize) {
 #ifdef DEBUG_LOG_GC
 	printf("%p free %ld: %zu bytes allocated total.\n", previous, oldSize, gc->bytesAllocated);
 #endif /* DEBUG_LOG_GC */
-	free(previous);
+	deferFree(gc, previous, oldSize);
 }
 
 Obj* allocateObject(size_t size, ObjType type, VM *vm) {
-	Obj *object = (Obj*)reallocate(vm, NULL, 0, size);
+	countAllocation(vm, 0, size);
+	vm->gc.types[type].allocated++;
+	vm->gc.types[type].bytesAllocated += size;
+	Obj *object = (Obj*)acquireMemory(&vm->gc, size, true);
 	object->type = type;
-	object->isBlack = false;
-	object->isGrey = true;
-	object->next = vm->gc.objects;
-	vm->gc.objects = object;
+	object->inArena = size <= ARENA_MAX_SIZE;
+	linkObject(&vm->gc, object);
+	if(vm->gc.profile)
+		profileAllocation(vm, object, size);
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %ld for %s: %zu bytes allocated total.\n", (void*)object, size, ObjTypeNames[type], vm->gc.bytesAllocated);
 #endif /* DEBUG_LOG_GC */
@@ -398,7 +1266,19 @@ Obj* allocateObject(size_t size, ObjType type, VM *vm) {
 }
 
 void setGrey(GarbageCollector *gc, Obj *o) {
+	if(gc->concurrent)
+		return;	// The gray stack belongs to the marker thread, and overwritten references are logged instead.
 	o->isGrey = true;
-	if(o->isBlack)
-		pushGrayStack(gc, o);
+	if(isBlack(gc, o))
+		pushGrayStack(&gc->gray, o);
+}
+
+void logOverwrite(GarbageCollector *gc, Value v) {
+	if(!IS_OBJ(v) || isBlack(gc, AS_OBJ(v)))
+		return;
+	if(gc->satbCapacity < gc->satbCount + 1) {
+		gc->satbCapacity = GROW_CAPACITY(gc->satbCapacity);
+		gc->satb = realloc(gc->satb, sizeof(Obj*) * gc->satbCapacity);
+	}
+	gc->satb[gc->satbCount++] = AS_OBJ(v);
 }
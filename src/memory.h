@@ -3,7 +3,9 @@
 
 #include <limits.h>
 #include <stddef.h>
+#include <string.h>
 
+#include "arena.h"
 #include "object.h"
 #include "vm.h"
 
@@ -38,9 +40,91 @@
 #define FREE(gc, type, pointer) \
 	_free(gc, pointer, sizeof(type))
 
-#define isWhite(o) (!((Obj*)(o))->isBlack)
+// Objects in the arena keep their mark in their page, so sweeping doesn't touch the objects that survive.
+static inline bool markOf(const Obj *o) {
+	if(!o->inArena)
+		return o->mark;
+	ArenaPage *page = pageOf(o);
+	size_t i = cellIndex(page, o);
+	return (page->marks[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void setMark(Obj *o, bool mark) {
+	if(!o->inArena) {
+		o->mark = mark;
+		return;
+	}
+	ArenaPage *page = pageOf(o);
+	size_t i = cellIndex(page, o);
+	uint64_t bit = (uint64_t)1 << (i % 64);
+	if(mark)
+		page->marks[i / 64] |= bit;
+	else
+		page->marks[i / 64] &= ~bit;
+}
+
+// Sets the mark of an object that other threads are marking too.  Returns false if it already had that mark.
+static inline bool claimMark(Obj *o, bool mark) {
+	if(!o->inArena)
+		return __atomic_exchange_n(&o->mark, mark, __ATOMIC_RELAXED) != mark;
+	ArenaPage *page = pageOf(o);
+	size_t i = cellIndex(page, o);
+	uint64_t bit = (uint64_t)1 << (i % 64);
+	uint64_t old = mark ? __atomic_fetch_or(&page->marks[i / 64], bit, __ATOMIC_RELAXED) : __atomic_fetch_and(&page->marks[i / 64], ~bit, __ATOMIC_RELAXED);
+	return ((old & bit) != 0) != mark;
+}
+
+#define isBlack(gc, o) (markOf((Obj*)(o)) == (gc)->blackMark)
+#define isWhite(gc, o) (!isBlack((gc), (o)))
 #define isGrey(o) (((Obj*)(o))->isGrey)
+// Must follow any store of a young object into an object that might be old.
 #define writeBarrier(vm, o) if(!isGrey((o))) setGrey(&(vm)->gc, ((Obj*)(o)))
+// Must precede any store that overwrites a reference in the heap, so the marker thread still finds what it pointed to.
+#define satbBarrier(vm, v) if((vm)->gc.concurrent) logOverwrite(&(vm)->gc, (v))
+// Must follow any read of a weak reference.  The marker thread may not have found the object, and won't see where the program puts it.
+#define keepAlive(vm, v) satbBarrier((vm), (v))
+
+// The marker thread reads the size of an array or table, then its buffer, while the program grows them.
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+
+void growObjects(ObjVector *v);
+
+static inline void pushObject(ObjVector *v, Obj *o) {
+	if(v->count == v->capacity)
+		growObjects(v);
+	v->items[v->count++] = o;
+}
+
+// Objects allocated while the marker thread is running are black, since it never traces them.
+static inline void linkObject(GarbageCollector *gc, Obj *object) {
+	if(gc->concurrent) {
+		claimMark(object, gc->blackMark);	// The workers may be marking other cells in the same page.
+		object->isGrey = false;
+		if((object->type == OBJ_STRING) && gc->weakKeyTables)
+			pushObject(&gc->gray.strings, object);	// It is never blackened, so clearWeakTables wouldn't see it.
+		// The marker thread must see the mark before it can find the object.
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	} else {
+		setMark(object, !gc->blackMark);
+		object->isGrey = true;	// Young objects don't need writeBarrier.
+	}
+	pushObject(&gc->young, object);
+}
+
+// While the arena is being compacted, an object that has moved holds its new address in its first word after the header.
+static inline Obj *forwardObject(Obj *o) {
+	if((o != NULL) && o->inArena && pageOf(o)->evacuating)
+		return ((Obj**)o)[1];
+	return o;
+}
+
+static inline void forwardValue(Value *v) {
+	if(IS_OBJ(*v))
+		*v = OBJ_VAL(forwardObject(AS_OBJ(*v)));
+}
+
+#define FORWARD(p) ((p) = (void*)forwardObject((Obj*)(p)))
 
 static inline size_t round_up_pow_2(size_t n) {
 	n--;
@@ -51,11 +135,76 @@ static inline size_t round_up_pow_2(size_t n) {
 }
 
 Obj* allocateObject(size_t size, ObjType type, VM *vm);
+size_t objectSize(Obj *object);
 void* reallocate(VM *vm, void* previous, size_t oldSize, size_t newSize);
 void _free(GarbageCollector *gc, void* previous, size_t oldSize);
-void markValue(GarbageCollector *gc, Value v);
+void markValue(GrayStack *s, Value v);
+void markSlots(GrayStack *s, Value *slots, size_t capacity, size_t count);
 void freeObjects(GarbageCollector *gc);
 void freeChunk(GarbageCollector *gc, Chunk *chunk);
 void setGrey(GarbageCollector *gc, Obj *o);
+void logOverwrite(GarbageCollector *gc, Value v);
+void initMarker(GarbageCollector *gc, unsigned int threads);
+void pinObject(Obj *o);
+void unpinObject(Obj *o);
+// In milliseconds.
+double pauseBucketStart(size_t bucket);
+double pausePercentile(GarbageCollector *gc, double p);
+void compactHeap(VM *vm);
+
+// Must follow a lookup in the intern table.  A string that a major cycle didn't reach stays in it until the sweep frees it, so one found before then is blackened to keep it.
+static inline void keepInterned(VM *vm, ObjString *string) {
+	if((vm->gc.phase == GC_SWEEP) && isWhite(&vm->gc, string))
+		setMark((Obj*)string, vm->gc.blackMark);
+	else
+		keepAlive(vm, OBJ_VAL(string));
+}
+
+// Arrays and tables with at least GC_CARD_MIN slots keep a card table after the end of their buffer.
+// A store dirties the card it falls in, so a collection only rescans those cards of an old buffer.
+typedef struct {
+	size_t epoch;		// The gc's cardEpoch when every slot was last scanned.
+	uint8_t dirty[];
+} CardTable;
+
+static inline bool hasCards(size_t capacity) {
+	return capacity >= GC_CARD_MIN;
+}
+
+static inline size_t cardCount(size_t capacity) {
+	return (capacity + GC_CARD_SIZE - 1) / GC_CARD_SIZE;
+}
+
+static inline CardTable *cardsOf(Value *slots, size_t capacity) {
+	return (CardTable*)(slots + capacity);
+}
+
+static inline size_t slotsSize(size_t capacity) {
+	return sizeof(Value) * capacity + (hasCards(capacity) ? sizeof(CardTable) + cardCount(capacity) : 0);
+}
+
+// A new card table has never been scanned, so the whole buffer is scanned the next time it is marked.
+static inline Value *initCards(Value *slots, size_t capacity) {
+	if(hasCards(capacity)) {
+		CardTable *cards = cardsOf(slots, capacity);
+		cards->epoch = 0;
+		memset(cards->dirty, 0, cardCount(capacity));
+	}
+	return slots;
+}
+
+#define ALLOCATE_SLOTS(vm, capacity) \
+	initCards(reallocate(vm, NULL, 0, slotsSize(capacity)), (capacity))
+#define GROW_SLOTS(vm, previous, oldCapacity, capacity) \
+	initCards(reallocate(vm, previous, slotsSize(oldCapacity), slotsSize(capacity)), (capacity))
+#define FREE_SLOTS(gc, pointer, oldCapacity) \
+	_free(gc, pointer, slotsSize(oldCapacity))
+
+// Must follow any store into the buffer of an array or table that might be old.
+static inline void slotBarrier(VM *vm, Obj *o, Value *slots, size_t capacity, size_t i) {
+	if(hasCards(capacity))
+		cardsOf(slots, capacity)->dirty[i / GC_CARD_SIZE] = 1;
+	writeBarrier(vm, o);
+}
 
 #endif /* XAN_MEMORY_H */
@@ -8,6 +8,7 @@
 #include "exception.h"
 #include "memory.h"
 #include "table.h"
+#include "xanString.h"
 
 ObjFunction *newFunction(VM *vm, thread *currentThread, size_t uvCount, size_t varArityCount) {
 	ObjFunction *f = (ObjFunction*)allocateObject(sizeof(*f) + uvCount * sizeof(uint16_t) + varArityCount * sizeof(size_t), OBJ_FUNCTION, vm);
@@ -19,7 +20,7 @@ ObjFunction *newFunction(VM *vm, thread *currentThread, size_t uvCount, size_t v
 	f->stackUsed = 0;
 	f->name = NULL;
 	f->code_offsets = (size_t*)&f->uv[f->uvCount];
-	initChunk(vm, currentThread, &f->chunk);
+	memset(&f->chunk, 0, sizeof(f->chunk));	// The caller moves the compiled chunk in, so there's nothing to allocate.
 	return f;
 }
 
@@ -58,6 +59,7 @@ ObjClass *newClass(VM *vm, thread *currentThread, ObjString *name) {
 	klass->methods = NULL;
 	klass->cname = NULL;
 	klass->methodsArray = NULL;
+	klass->newFn = NULL;
 	currentThread->base[0] = OBJ_VAL(klass);	// name is still reachable through klass.
 	incCFrame(vm, currentThread, 1, 3);
 	klass->methods = newTable(vm, currentThread, 0);
@@ -75,11 +77,10 @@ void defineNative(VM *vm, thread *currentThread, ObjTable *t, const NativeDef *f
 
 void defineNativeClass(VM *vm, thread *currentThread, ObjTable *t, ObjClass *klass) {
 	klass->name = copyString(vm, currentThread, klass->cname, strlen(klass->cname));
-	writeBarrier(vm, klass);
 
 	// klass is statically allocated, so it avoids newClass. This puts it in the linked list of objects for the garbage collector.
-	klass->obj.next = vm->gc.objects;
-	vm->gc.objects = (Obj*)klass;
+	// It may already have been marked through an object that uses it, so it starts over as a young object.
+	linkObject(&vm->gc, (Obj*)klass);
 
 	currentThread->base[0] = OBJ_VAL(klass);
 
@@ -106,7 +107,9 @@ ObjModule * newModule(VM *vm, thread *currentThread, ObjString *name) {
 	module->fields = NULL;
 	currentThread->base[0] = OBJ_VAL(module);
 	module->klass = &moduleDef;
+	incCFrame(vm, currentThread, 1, 3);
 	module->fields = newTable(vm, currentThread, 0);
+	decCFrame(currentThread);
 	writeBarrier(vm, module);
 	return module;
 }
@@ -157,17 +160,19 @@ void setArray(VM *vm, ObjArray *array, int idx, Value v) {
 	assert(idx >= 0);
 	if((size_t)idx >= array->capacity) {
 		size_t capacity = GROW_CAPACITY(round_up_pow_2(idx));
-		array->values = GROW_ARRAY(vm, array->values, Value, array->capacity, capacity);
+		array->values = GROW_SLOTS(vm, array->values, array->capacity, capacity);
 		array->capacity = capacity;
 	}
 
 	for(size_t i = array->count; i < (size_t)idx; i++)
 		array->values[i] = NIL_VAL;
 
+	if((size_t)idx < array->count)
+		satbBarrier(vm, array->values[idx]);
 	array->values[idx] = v;
+	slotBarrier(vm, (Obj*)array, array->values, array->capacity, idx);
 	if((size_t)idx >= array->count)
-		array->count = (size_t)idx + 1;
-
+		STORE_RELEASE(&array->count, (size_t)idx + 1);
 }
 
 bool getArray(ObjArray *array, int idx, Value *ret) {
@@ -241,6 +246,9 @@ void fprintObject(FILE *restrict stream, Value value) {
 				fprintf(stream, "%s", AS_CSTRING(value));
 			}
 			break;
+		case OBJ_ROPE:
+			fprintRope(stream, AS_ROPE(value));
+			break;
 		case OBJ_TABLE:
 			fprintTable(stream, AS_TABLE(value));
 			break;
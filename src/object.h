@@ -19,6 +19,7 @@
 #define AS_MODULE(value)       (((ObjModule*)AS_OBJ(value)))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 #define AS_TABLE(value)        ((ObjTable*)AS_OBJ(value))
 #define AS_EXCEPTION(value)    ((ObjException*)AS_OBJ(value))
 
@@ -100,7 +101,8 @@ ObjModule *defineNativeModule(VM *vm, thread *currentThread, ModuleDef *def);
 ObjArray *duplicateArray(VM *vm, thread *currentThread, ObjArray *source);
 void setArray(VM *vm, ObjArray *array, int idx, Value v);	// It is the caller's responsability to ensure that v is findable by the GC.
 bool getArray(ObjArray *array, int idx, Value *ret);
-ObjString *takeString(VM *vm, thread *currentThread, char *chars, size_t length);
+ObjString *allocateString(VM *vm, thread *currentThread, size_t length);
+ObjString *internString(VM *vm, ObjString *string);
 ObjString *copyString(VM *vm, thread *currentThread, const char *chars, size_t length);
 void fprintObject(FILE *restrict stream, Value value);
 void printObject(Value value);
@@ -1,5 +1,6 @@
 #include "parse.h"
 
+#include <math.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -7,7 +8,9 @@
 
 #include "memory.h"
 #include "debug.h"
+#include "peephole.h"
 #include "table.h"
+#include "xanString.h"
 
 typedef struct {
 	Token current;
@@ -85,6 +88,9 @@ typedef struct {
 #define ExprHasJump(e)				((e)->true_jump != (e)->false_jump)
 #define ExprIsConstant(e)			((e)->type <= NUMBER_EXTYPE)
 #define ExprIsConstantHasNoJump(e)	(ExprIsConstant(e) && !ExprHasJump(e))
+#define ExprIsNumberHasNoJump(e)	((e)->type == NUMBER_EXTYPE && !ExprHasJump(e))
+#define ExprIsStringHasNoJump(e)	((e)->type == STRING_EXTYPE && !ExprHasJump(e))
+#define ExprIsTruthy(e)				(((e)->type != NIL_EXTYPE) && ((e)->type != FALSE_EXTYPE))	// Only meaningful for constants.
 
 #ifdef DEBUG_PARSER
 static void printExpr(FILE *restrict stream, expressionDescription *e) {
@@ -190,13 +196,11 @@ static bool jump_patch_test_reg(Chunk *c, OP_position pc, Reg r) {
 			setbc_a(ip, r);
 		}
 		return true;
-	} else if(RA(*ip) == NO_REG) {
+	} else if(!isLongJump(op) && (RA(*ip) == NO_REG)) {
 		if(r == NO_REG) {
-			*ip = OP_AJump(OP_JUMP, RA(c->code[pc]), 0);
+			*ip = OP_Jump(OP_JUMP, 0);
 		} else {
 			setbc_a(ip, r);
-			if(r >= RA(ip[1]))
-				setbc_a(ip+1, r+1);
 		}
 		return true;
 	}
@@ -205,15 +209,14 @@ static bool jump_patch_test_reg(Chunk *c, OP_position pc, Reg r) {
 
 static void jump_patch_instruction(Parser *p, OP_position src, OP_position dest) {
 	PRINT_FUNCTION;
-	OP_position offset = dest - (src+1) + JUMP_BIAS;
+	ptrdiff_t offset = (ptrdiff_t)dest - (ptrdiff_t)(src+1);
 #if defined(DEBUG_PARSER) || defined(DEBUG_JUMP_LISTS)
-	fprintf(stderr, "src = %u\tdest = %u\toffset = %x\n", src, dest, offset);
+	fprintf(stderr, "src = %u\tdest = %u\toffset = %td\n", src, dest, offset);
 #endif /* DEBUG_PARSER */
 	assert(dest != NO_JUMP);
-	if(offset > MAX_D)
-		errorAtPrevious(p, "Too much code to jump over.");
 	uint32_t *jump = &currentChunk(p->currentCompiler)->code[src];
-	setbc_d(jump, offset);
+	if(!setJumpOffset(jump, offset))
+		errorAtPrevious(p, "Too much code to jump over.");
 }
 
 static OP_position jump_next(Chunk *c, OP_position pc) {
@@ -221,7 +224,7 @@ static OP_position jump_next(Chunk *c, OP_position pc) {
 #ifdef DEBUG_JUMP_LISTS
 	fprintf(stderr, "pc = %u\tNO_JUMP = %u\n", pc, NO_JUMP);
 #endif /* DEBUG_JUMP_LISTS */
-	ptrdiff_t delta = RJump(c->code[pc]);
+	ptrdiff_t delta = getJumpOffset(c->code[pc]);
 	if((OP_position)delta == NO_JUMP)
 		return NO_JUMP;
 	OP_position ret = (OP_position)(((ptrdiff_t)pc+1)+delta);
@@ -284,6 +287,13 @@ static size_t emit_ABC(Parser *p, ByteCode op, Reg a, Reg b, Reg c) {
 	return emitBytecode(p, OP_ABC(op, a, b, c));
 }
 
+// Emits an instruction whose RC indexes the constant table.  Constants past MAX_REG get an OP_EXTENDED prefix carrying the high bits.
+static size_t emit_ABCk(Parser *p, ByteCode op, Reg a, Reg b, uint16_t k) {
+	if(k > MAX_REG)
+		emit_AD(p, OP_EXTENDED, 0, k >> 8);
+	return emit_ABC(p, op, a, b, (Reg)k);
+}
+
 static inline void exprInit(expressionDescription *e, expressionType type, uint16_t info) {
 	e->type = type;
 	if(e->type == GLOBAL_EXTYPE) {
@@ -348,7 +358,7 @@ static void exprDischarge(Parser *p, expressionDescription *e) {
 			int rkey = e->u.s.aux;
 			if((rkey < 0) && (e->type == INDEXED_EXTYPE)) {
 				regFree(p->currentCompiler, (Reg)e->u.s.info);
-				e->u.s.info = emit_ABC(p, OP_GET_PROPERTYK, 0, (Reg)e->u.s.info, (Reg)~rkey);
+				e->u.s.info = emit_ABCk(p, OP_GET_PROPERTYK, 0, (Reg)e->u.s.info, (uint16_t)~rkey);
 			} else {
 				regFree(p->currentCompiler, rkey);
 				regFree(p->currentCompiler, (Reg)e->u.s.info);
@@ -482,7 +492,7 @@ static void jump_append(Parser *p, OP_position *list1, OP_position list2) {
 static bool jump_novalue(Chunk *c, OP_position list) {
 	while(list != NO_JUMP) {
 		uint32_t p = c->code[list >= 1 ? list-1 : list];
-		if(!(OP(p) == OP_COPY_JUMP_IF_TRUE || OP(p) == OP_COPY_JUMP_IF_FALSE || RA(p) == NO_REG))
+		if(!(OP(p) == OP_COPY_JUMP_IF_TRUE || OP(p) == OP_COPY_JUMP_IF_FALSE || (!isLongJump(OP(p)) && RA(p) == NO_REG)))
 			return true;
 		list = jump_next(c, list);
 	}
@@ -495,7 +505,7 @@ static size_t _emit_jump(Parser *p, ByteCode op, Reg a) {
 	printPendingJumps(c);
 	OP_position pjl = c->pendingJumpList;
 	c->pendingJumpList = NO_JUMP;
-	OP_position j = emit_AJ(p, op, a, (uint16_t)NO_JUMP);
+	OP_position j = isLongJump(op) ? emitBytecode(p, OP_Jump(op, -1)) : emit_AJ(p, op, a, (uint16_t)NO_JUMP);
 	jump_append(p, &j, pjl);
 	printPendingJumps(c);
 	return j;
@@ -553,9 +563,14 @@ static OP_position emit_branch(Parser *p, expressionDescription *e, bool cond) {
 
 static void emit_branch_true(Parser *p, expressionDescription *e) {
 	exprDischarge(p, e);
-	// TODO handle constant expressions.
 	OP_position pc;
-	if(e->type == JUMP_EXTYPE) {
+	if((e->type == STRING_EXTYPE) || (e->type == NUMBER_EXTYPE) || (e->type == TRUE_EXTYPE)) {
+		pc = NO_JUMP;	// Never jump.
+	} else if((e->type == NIL_EXTYPE) || (e->type == FALSE_EXTYPE)) {
+		// Always jump. The value is loaded into NO_REG, so that jump_patch_test_reg can retarget it.
+		exprToRegNoBranch(p, e, NO_REG);
+		pc = emit_jump(p, OP_JUMP);
+	} else if(e->type == JUMP_EXTYPE) {
 		invertCond(p->currentCompiler, e);
 		pc = e->u.s.info;
 	} else {
@@ -568,9 +583,14 @@ static void emit_branch_true(Parser *p, expressionDescription *e) {
 
 static void emit_branch_false(Parser *p, expressionDescription *e) {
 	exprDischarge(p, e);
-	// TODO handle constant expressions.
 	OP_position pc;
-	if(e->type == JUMP_EXTYPE) {
+	if((e->type == NIL_EXTYPE) || (e->type == FALSE_EXTYPE)) {
+		pc = NO_JUMP;	// Never jump.
+	} else if((e->type == STRING_EXTYPE) || (e->type == NUMBER_EXTYPE) || (e->type == TRUE_EXTYPE)) {
+		// Always jump. See emit_branch_true.
+		exprToRegNoBranch(p, e, NO_REG);
+		pc = emit_jump(p, OP_JUMP);
+	} else if(e->type == JUMP_EXTYPE) {
 		pc = e->u.s.info;
 	} else {
 		pc = emit_branch(p, e, true);
@@ -594,7 +614,7 @@ static void exprToReg(Parser *p, expressionDescription *e, Reg r) {
 		if(jump_novalue(currentChunk(p->currentCompiler), e->true_jump) || jump_novalue(currentChunk(p->currentCompiler), e->false_jump)) {
 			OP_position jump_val = e->type == JUMP_EXTYPE ? NO_JUMP : emit_jump(p, OP_JUMP);
 			jump_false = emit_AD(p, OP_PRIMITIVE, r, FALSE_EXTYPE);
-			emit_AJ(p, OP_JUMP, p->currentCompiler->nextReg, 1);
+			emitBytecode(p, OP_Jump(OP_JUMP, 1));
 			jump_true = emit_AD(p, OP_PRIMITIVE, r, TRUE_EXTYPE);
 			jump_to_here(p, jump_val);
 		}
@@ -654,6 +674,92 @@ static void expr_toval(Parser *p, expressionDescription *e) {
 		exprDischarge(p, e);
 }
 
+static Value exprConstantValue(expressionDescription *e) {
+	assert(ExprIsConstant(e));
+	if((e->type == STRING_EXTYPE) || (e->type == NUMBER_EXTYPE))
+		return e->u.v;
+	return getPrimitive((primitive)e->type);
+}
+
+static void exprInitConstant(expressionDescription *e, Value v) {
+	if(IS_NUMBER(v)) {
+		exprInit(e, NUMBER_EXTYPE, 0);
+	} else if(IS_OBJ(v)) {
+		assert(IS_STRING(v));
+		exprInit(e, STRING_EXTYPE, 0);
+	} else {
+		exprInit(e, IS_NIL(v) ? NIL_EXTYPE : AS_BOOL(v) ? TRUE_EXTYPE : FALSE_EXTYPE, 0);
+		return;
+	}
+	e->u.v = v;
+}
+
+static bool foldNumber(expressionDescription *e, double n) {
+	// NaN, infinities and -0 don't survive the deduplication in addConstant, so they are left for the VM.
+	if(isnan(n) || isinf(n) || ((n == 0) && signbit(n)))
+		return false;
+	e->u.v = NUMBER_VAL(n);
+	return true;
+}
+
+static bool foldArith(Parser *p, ByteCode op, expressionDescription *e1, expressionDescription *e2) {
+	if((op == OP_ADDVV) && ExprIsStringHasNoJump(e1) && ExprIsStringHasNoJump(e2)) {
+		incCFrame(p->vm, p->currentThread, 3, 3);
+		p->currentThread->base[1] = e1->u.v;
+		p->currentThread->base[2] = e2->u.v;
+		ObjString *s = internString(p->vm, concatenate(p->vm, p->currentThread, AS_STRING(e1->u.v), AS_STRING(e2->u.v)));
+		decCFrame(p->currentThread);
+		p->currentThread->base[0] = e1->u.v = OBJ_VAL(s);
+		addConstant(p->vm, currentChunk(p->currentCompiler), e1->u.v);
+		return true;
+	}
+	if(!ExprIsNumberHasNoJump(e1) || !ExprIsNumberHasNoJump(e2))
+		return false;
+	double b = AS_NUMBER(e1->u.v);
+	double c = AS_NUMBER(e2->u.v);
+	switch(op) {
+		case OP_ADDVV: return foldNumber(e1, b + c);
+		case OP_SUBVV: return foldNumber(e1, b - c);
+		case OP_MULVV: return foldNumber(e1, b * c);
+		case OP_DIVVV: return foldNumber(e1, b / c);
+		case OP_MODVV: return foldNumber(e1, fmod(b, c));
+		default: return false;
+	}
+}
+
+static bool foldComp(ByteCode op, expressionDescription *e1, expressionDescription *e2) {
+	if(!ExprIsConstantHasNoJump(e1) || !ExprIsConstantHasNoJump(e2))
+		return false;
+	bool result;
+	if((op == OP_EQUAL) || (op == OP_NEQ)) {
+		result = valuesEqual(exprConstantValue(e1), exprConstantValue(e2)) == (op == OP_EQUAL);
+	} else if(ExprIsNumberHasNoJump(e1) && ExprIsNumberHasNoJump(e2)) {
+		double b = AS_NUMBER(e1->u.v);
+		double c = AS_NUMBER(e2->u.v);
+		switch(op) {
+			case OP_GREATER: result = b > c; break;
+			case OP_GEQ:     result = b >= c; break;
+			case OP_LESS:    result = b < c; break;
+			case OP_LEQ:     result = b <= c; break;
+			default: return false;
+		}
+	} else {
+		return false;	// Leave the type error for runtime.
+	}
+	exprInit(e1, result ? TRUE_EXTYPE : FALSE_EXTYPE, 0);
+	return true;
+}
+
+static bool foldUnary(ByteCode op, expressionDescription *e) {
+	if(!ExprIsConstantHasNoJump(e))
+		return false;
+	if(op == OP_NOT) {
+		exprInit(e, ExprIsTruthy(e) ? FALSE_EXTYPE : TRUE_EXTYPE, 0);
+		return true;
+	}
+	return (op == OP_NEGATE) && (e->type == NUMBER_EXTYPE) && foldNumber(e, -AS_NUMBER(e->u.v));
+}
+
 XAN_STATIC_ASSERT(OP_SUBVK == OP_SUBVV + (OP_ADDVK - OP_ADDVV));
 XAN_STATIC_ASSERT(OP_MULVK == OP_MULVV + (OP_ADDVK - OP_ADDVV));
 XAN_STATIC_ASSERT(OP_DIVVK == OP_DIVVV + (OP_ADDVK - OP_ADDVV));
@@ -665,7 +771,7 @@ static void emit_arith(Parser *p, ByteCode op, expressionDescription *e1, expres
 	expr_toval(p, e2);
 	size_t rc;
 	if(((e2->type == NUMBER_EXTYPE) || (e2->type == STRING_EXTYPE)) &&
-			((rc = addConstant(p->vm, currentChunk(p->currentCompiler), e2->u.v)) <= MAX_REG))
+			((rc = addConstant(p->vm, currentChunk(p->currentCompiler), e2->u.v)) <= UINT16_MAX))
 		op += OP_ADDVK - OP_ADDVV;
 	else
 		rc = exprAnyReg(p, e2);
@@ -680,7 +786,10 @@ static void emit_arith(Parser *p, ByteCode op, expressionDescription *e1, expres
 #ifdef DEBUG_EXPRESSION_DESCRIPTION
 	e1->u.r.r = 0;
 #endif /* DEBUG_EXPRESSION_DESCRIPTION */
-	e1->u.s.info = emit_ABC(p, op, 0, rb, rc);
+	if(op >= OP_ADDVK)
+		e1->u.s.info = emit_ABCk(p, op, 0, rb, (uint16_t)rc);
+	else
+		e1->u.s.info = emit_ABC(p, op, 0, rb, (Reg)rc);
 	e1->type = RELOC_EXTYPE;
 }
 
@@ -714,15 +823,16 @@ static void emit_binop_left(Parser *p, ByteCode op, expressionDescription *e) {
 			emit_branch_false(p, e);
 			break;
 		default:
-			// TODO constants
-			exprAnyReg(p, e);
+			if(!ExprIsConstantHasNoJump(e))	// Constants wait for the right operand, so they can be folded.
+				exprAnyReg(p, e);
 	}
 }
 
 static void emit_binop(Parser *p, ByteCode op, expressionDescription *e1, expressionDescription *e2) {
 	PRINT_FUNCTION;
 	if((op == OP_ADDVV) || (op == OP_SUBVV) || (op == OP_MULVV) || (op == OP_DIVVV) || (op == OP_MODVV)) {	// TODO make this a single comparison: op <= ??????
-		emit_arith(p, op, e1, e2);
+		if(!foldArith(p, op, e1, e2))
+			emit_arith(p, op, e1, e2);
 	} else if(op == OP_AND) {
 		assert(e1->true_jump == NO_JUMP);
 		exprDischarge(p, e2);
@@ -735,7 +845,8 @@ static void emit_binop(Parser *p, ByteCode op, expressionDescription *e1, expres
 		*e1 = *e2;
 	} else {
 		assert((op == OP_EQUAL) || (op == OP_NEQ) || (op == OP_LESS) || (op == OP_LEQ) || (op == OP_GREATER) || (op == OP_GEQ));
-		emit_comp(p, op, e1, e2);
+		if(!foldComp(op, e1, e2))
+			emit_comp(p, op, e1, e2);
 	}
 }
 
@@ -755,7 +866,7 @@ static void emit_store(Parser *p, expressionDescription *variable, expressionDes
 		Reg ra = exprAnyReg(p, e);
 		int32_t rc = variable->u.s.aux;
 		if((variable->type == INDEXED_EXTYPE) && (rc < 0)) {
-			emit_ABC(p, OP_SET_PROPERTYK, ra, variable->u.s.info, (Reg)~rc);
+			emit_ABCk(p, OP_SET_PROPERTYK, ra, variable->u.s.info, (uint16_t)~rc);
 			variable->u.s.info = ra;
 			variable->type = NONRELOC_EXTYPE;
 			return;
@@ -840,6 +951,7 @@ static void initCompiler(Parser *p, Compiler *compiler, FunctionType type) {
 	p->currentThread->currentCompiler = compiler;
 	compiler->type = type;
 	compiler->scopeDepth = 0;
+	compiler->assigned = NULL;
 	compiler->minArity = 0;
 	compiler->maxArity = 0;
 	compiler->defaultArgs = NULL;
@@ -860,6 +972,7 @@ static void initCompiler(Parser *p, Compiler *compiler, FunctionType type) {
 	Local *local = &compiler->locals[compiler->actVar];
 	local->depth = 0;
 	local->isCaptured = false;
+	local->isConstant = false;
 	if((type == TYPE_METHOD) || (type == TYPE_INITIALIZER)) {
 		local->name.start = "this";
 		local->name.length = 4;
@@ -869,7 +982,17 @@ static void initCompiler(Parser *p, Compiler *compiler, FunctionType type) {
 	}
 }
 
+static void freeAssignedNames(Compiler *c, int depth) {
+	while(c->assigned && (c->assigned->depth >= depth)) {
+		AssignedNames *enclosing = c->assigned->enclosing;
+		free(c->assigned->names);
+		free(c->assigned);
+		c->assigned = enclosing;
+	}
+}
+
 static ObjFunction *endCompiler(Parser *p) {
+	freeAssignedNames(p->currentCompiler, 0);
 	Chunk *c = currentChunk(p->currentCompiler);
 	finalizeChunk(&p->currentCompiler->chunk);
 	if((c->count == 0) || (p->currentCompiler->pendingJumpList != NO_JUMP) || (OP(c->code[c->count-1])) != OP_RETURN) {
@@ -882,6 +1005,8 @@ static ObjFunction *endCompiler(Parser *p) {
 		emitReturn(p, &e);
 	}
 	assert(p->currentCompiler->maxArity - p->currentCompiler->minArity >= 0);
+	if(!p->hadError)
+		optimizeChunk(p->vm, c, p->currentCompiler->code_offsets, p->currentCompiler->maxArity - p->currentCompiler->minArity + 1);
 	ObjFunction *f = newFunction(p->vm, p->currentThread, p->currentCompiler->uvCount, p->currentCompiler->maxArity - p->currentCompiler->minArity + 1);
 	f->minArity = p->currentCompiler->minArity;
 	f->maxArity = p->currentCompiler->maxArity;
@@ -932,6 +1057,7 @@ static int addLocal(Parser *p, Token name) {
 	local->name = name;
 	local->depth = -1;
 	local->isCaptured = false;
+	local->isConstant = false;
 	return c->actVar - 1;
 }
 
@@ -1084,12 +1210,9 @@ static void expressionIndexed(Parser *p, expressionType type, expressionDescript
 	PRINT_FUNCTION;
 	e->type = type;
 	if((type == INDEXED_EXTYPE) && (k->type == STRING_EXTYPE)) {
-		uint16_t kidx = makeConstant(p, k->u.v);
-		if(kidx <= MAX_REG) {
-			e->u.s.aux = ~kidx;
-			e->assignable = true;
-			return;
-		}
+		e->u.s.aux = ~makeConstant(p, k->u.v);
+		e->assignable = true;
+		return;
 	}
 	e->u.s.aux = exprAnyReg(p, k);
 	e->assignable = true;
@@ -1160,6 +1283,9 @@ static void makeStringConstant(Parser *p, expressionDescription *e, const char *
 #endif /* DEBUG_EXPRESSION_DESCRIPTION */
 	e->u.v = OBJ_VAL(copyString(p->vm, p->currentThread, s, length));
 	e->true_jump = e->false_jump = NO_JUMP;
+	// An expression isn't a root, so the string is kept alive as a constant, even if it gets folded away.
+	p->currentThread->base[0] = e->u.v;
+	addConstant(p->vm, currentChunk(p->currentCompiler), e->u.v);
 }
 
 static void string(Parser *p, expressionDescription *e) {
@@ -1294,6 +1420,8 @@ static void unary(Parser *p, expressionDescription *e) {
 
 	advance(p);
 	binary(p, e, PREC_UNARY);
+	if(foldUnary(op, e))
+		return;
 	exprAnyReg(p, e);
 	exprFree(p->currentCompiler, e);
 	exprInit(e, RELOC_EXTYPE, emit_AD(p, op, 0, e->u.r.r));
@@ -1324,7 +1452,10 @@ static int16_t var_lookup(Parser *p, Compiler *c, Token *name, expressionDescrip
 	if(c) {
 		int16_t arg = resolveLocal(p, c, name);
 		assert((-2 <= arg) && (arg <= UINT8_COUNT));
-		if(arg >= -1) {
+		if((arg >= -1) && c->locals[arg+1].isConstant) {
+			exprInitConstant(e, c->locals[arg+1].constant);
+			return -2;	// Nothing to capture.
+		} else if(arg >= -1) {
 			exprInit(e, LOCAL_EXTYPE, arg);
 			e->assignable = true;
 			if(!local)
@@ -1553,22 +1684,53 @@ static void expressionStatement(Parser *p) {
 #endif /* DEBUG_PARSER */
 }
 
+static OP_position condition(Parser *p, expressionDescription *e) {
+	if(e->type == NIL_EXTYPE) e->type = FALSE_EXTYPE;
+	emit_branch_true(p, e);
+	return e->false_jump;
+}
+
 static OP_position expressionCondition(Parser *p) {
 	expressionDescription e;
 	expression(p, &e);
-
-	if(e.type == NIL_EXTYPE) e.type = FALSE_EXTYPE;
-	emit_branch_true(p, &e);
-	return e.false_jump;
+	return condition(p, &e);
 }
 
 static void statement(Parser *p);
 
+static void deadStatement(Parser *p) {
+	// The statement can never execute. Compile it to report errors, then throw away the code.
+	Compiler *c = p->currentCompiler;
+	OP_position start = currentChunk(c)->count;
+	OP_position pendingJumpList = c->pendingJumpList;
+	OP_position pendingBreakList = c->pendingBreakList;
+	OP_position pendingContinueList = c->pendingContinueList;
+	c->pendingJumpList = NO_JUMP;	// Keep live jumps from being threaded through dead code.
+
+	statement(p);
+
+	truncateChunk(currentChunk(c), start);
+	c->pendingJumpList = pendingJumpList;
+	c->pendingBreakList = pendingBreakList;
+	c->pendingContinueList = pendingContinueList;
+}
+
 static void ifStatement(Parser *p) {
 	PRINT_FUNCTION;
 	consume(p, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	expressionDescription cond;
+	expression(p, &cond);
+	if(ExprIsConstantHasNoJump(&cond)) {
+		consume(p, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+		bool isTruthy = ExprIsTruthy(&cond);
+		if(isTruthy) statement(p); else deadStatement(p);
+		if(match(p, TOKEN_ELSE)) {
+			if(isTruthy) deadStatement(p); else statement(p);
+		}
+		return;
+	}
 	OP_position escapelist = NO_JUMP;
-	OP_position flist = expressionCondition(p);
+	OP_position flist = condition(p, &cond);
 	consume(p, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 	statement(p);
 	if(match(p, TOKEN_ELSE)) {
@@ -1603,6 +1765,7 @@ static bool endScope(Parser *p, bool closeUpvalues) {
 #ifdef DEBUG_PARSER
 	fprintf(stderr, "nextReg = %d\tactVar = %d\n", c->nextReg, c->actVar);
 #endif /* DEBUG_PARSER */
+	freeAssignedNames(c, c->scopeDepth);
 	c->scopeDepth--;
 	assert(c->scopeDepth >= 0);
 	return closeUpvalues;
@@ -1800,6 +1963,57 @@ static void funDeclaration(Parser *p) {
 	emitDefine(p, &name, &e);
 }
 
+static int compareNames(const void *a, const void *b) {
+	const Token *x = a;
+	const Token *y = b;
+	if(x->length != y->length)
+		return x->length < y->length ? -1 : 1;
+	return memcmp(x->start, y->start, x->length);
+}
+
+// Scans ahead to the end of the enclosing block, collecting everything that might be assigned to.
+static AssignedNames *scanAssignments(Parser *p, Compiler *c) {
+	AssignedNames *ret = malloc(sizeof(AssignedNames));
+	*ret = (AssignedNames){c->assigned, c->scopeDepth, NULL, 0};
+	size_t capacity = 0;
+	Scanner *s = duplicateScanner(p->s);
+	Token previous = p->previous;
+	Token current = p->current;
+	Token next = scanToken(s);
+	int depth = 0;
+	while(current.type != TOKEN_EOF) {
+		if(current.type == TOKEN_LEFT_BRACE) {
+			depth++;
+		} else if(current.type == TOKEN_RIGHT_BRACE) {
+			if(depth-- == 0)
+				break;
+		} else if((current.type == TOKEN_IDENTIFIER) && (next.type == TOKEN_EQUAL) && (previous.type != TOKEN_DOT)) {
+			if(ret->count == capacity) {
+				capacity = GROW_CAPACITY(capacity);
+				ret->names = realloc(ret->names, capacity * sizeof(Token));
+			}
+			ret->names[ret->count++] = current;
+		}
+		previous = current;
+		current = next;
+		next = scanToken(s);
+	}
+	endScanner(s);
+	if(ret->count > 0)	// names is NULL otherwise.
+		qsort(ret->names, ret->count, sizeof(Token), compareNames);
+	return ret;
+}
+
+// The scan starts at the scope's first constant local, and later ones are in the same block, so it covers them too.
+static bool isReassigned(Parser *p, Token *name) {
+	Compiler *c = p->currentCompiler;
+	if((c->assigned == NULL) || (c->assigned->depth != c->scopeDepth))
+		c->assigned = scanAssignments(p, c);
+	if(c->assigned->count == 0)
+		return false;
+	return bsearch(name, c->assigned->names, c->assigned->count, sizeof(Token), compareNames) != NULL;
+}
+
 static void varDeclaration(Parser *p) {
 	PRINT_FUNCTION;
 	expressionDescription v;
@@ -1809,7 +2023,8 @@ static void varDeclaration(Parser *p) {
 	fprintf(stderr, "nextReg = %d\n", p->currentCompiler->nextReg);
 #endif /* DEBUG_PARSER */
 	expressionDescription e;
-	if(match(p, TOKEN_EQUAL)) {
+	bool hasInitializer = match(p, TOKEN_EQUAL);
+	if(hasInitializer) {
 		expression(p, &e);
 	} else {
 		exprInit(&e, NIL_EXTYPE, 0);
@@ -1817,8 +2032,15 @@ static void varDeclaration(Parser *p) {
 	consume(p, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
 	if(!p->hadError) {
+		bool isConstant = hasInitializer && (v.type == LOCAL_EXTYPE) && ExprIsConstantHasNoJump(&e);
+		Value constant = isConstant ? exprConstantValue(&e) : NIL_VAL;
 		assign_adjust(p, &e);
 		emitDefine(p, &v, &e);
+		Local *local = &p->currentCompiler->locals[p->currentCompiler->actVar];
+		if(isConstant && !isReassigned(p, &local->name)) {
+			local->isConstant = true;
+			local->constant = constant;
+		}
 	}
 }
 
@@ -1846,6 +2068,124 @@ static void continueStatement(Parser *p) {
 	p->currentCompiler->pendingContinueList = c;
 }
 
+static bool isCountedLoop(Parser *p, double *step) {
+	// Look ahead for `name = init; name < limit; name = name + step)`, where limit is a number or a variable.
+	if(p->currentCompiler->nextReg + 3 >= MAX_REG)
+		return false;
+	Scanner *s = duplicateScanner(p->s);
+	Token name = p->current;
+	Token t = scanToken(s);
+	bool ret = false;
+#define NEXT_IS(tokenType) ((t = scanToken(s)).type == (tokenType))
+#define NEXT_IS_NAME() (NEXT_IS(TOKEN_IDENTIFIER) && identifiersEqual(&t, &name))
+	if((name.type != TOKEN_IDENTIFIER) || (t.type != TOKEN_EQUAL))
+		goto done;
+	int depth = 0;
+	do {	// Skip the initializer.
+		t = scanToken(s);
+		if((t.type == TOKEN_LEFT_PAREN) || (t.type == TOKEN_LEFT_BRACKET) || (t.type == TOKEN_LEFT_BRACE))
+			depth++;
+		else if((t.type == TOKEN_RIGHT_PAREN) || (t.type == TOKEN_RIGHT_BRACKET) || (t.type == TOKEN_RIGHT_BRACE))
+			depth--;
+		else if((t.type == TOKEN_EOF) || (t.type == TOKEN_ERROR) || (depth < 0))
+			goto done;
+	} while((depth != 0) || (t.type != TOKEN_SEMICOLON));
+
+	if(!NEXT_IS_NAME())
+		goto done;
+	t = scanToken(s);
+	if((t.type != TOKEN_LESS) && (t.type != TOKEN_LESS_EQUAL) && (t.type != TOKEN_GREATER) && (t.type != TOKEN_GREATER_EQUAL))
+		goto done;
+	t = scanToken(s);
+	if((t.type == TOKEN_MINUS) ? !NEXT_IS(TOKEN_NUMBER) :
+			((t.type != TOKEN_NUMBER) && ((t.type != TOKEN_IDENTIFIER) || identifiersEqual(&t, &name))))
+		goto done;
+	if(!NEXT_IS(TOKEN_SEMICOLON))
+		goto done;
+
+	if(!NEXT_IS_NAME() || !NEXT_IS(TOKEN_EQUAL) || !NEXT_IS_NAME())
+		goto done;
+	t = scanToken(s);
+	double sign = (t.type == TOKEN_MINUS) ? -1 : 1;
+	if(((t.type != TOKEN_PLUS) && (t.type != TOKEN_MINUS)) || !NEXT_IS(TOKEN_NUMBER))
+		goto done;
+	*step = sign * strtod(t.start, NULL);
+	ret = NEXT_IS(TOKEN_RIGHT_PAREN);
+#undef NEXT_IS_NAME
+#undef NEXT_IS
+done:
+	endScanner(s);
+	return ret;
+}
+
+static void countedForStatement(Parser *p, double step) {
+	// The index, limit and step live in adjacent registers, so that OP_FORLOOP can increment, compare and branch at once.
+	Compiler *c = p->currentCompiler;
+	size_t headerLine = p->previous.line;
+	varDeclaration(p);
+	Reg base = c->actVar - 1;
+
+	advance(p);	// The index.
+	ByteCode cmp;
+	switch(p->current.type) {
+		case TOKEN_LESS:          cmp = OP_LESS; break;
+		case TOKEN_LESS_EQUAL:    cmp = OP_LEQ; break;
+		case TOKEN_GREATER:       cmp = OP_GREATER; break;
+		default:                  cmp = OP_GEQ; break;
+	}
+	advance(p);
+	Token limitName = p->current;
+	expressionDescription limit;
+	expression(p, &limit);
+	expressionDescription limitSource = limit;
+	// A limit that can change during the loop has to be reloaded before each OP_FORLOOP.
+	bool reloadLimit = (limit.type == GLOBAL_EXTYPE) || (limit.type == UPVAL_EXTYPE) ||
+		((limit.type == LOCAL_EXTYPE) && isReassigned(p, &limitName));
+	consume(p, TOKEN_SEMICOLON, "Expected ';' after loop condition.");
+
+	Token hidden = syntheticToken("");
+	for(int i = 0; i < 2; i++) {
+		addLocal(p, hidden);
+		markInitialized(p);
+	}
+	regReserve(c, 2);
+	exprToReg(p, &limit, base + 1);
+	expressionDescription e;
+	exprInitConstant(&e, NUMBER_VAL(step));
+	exprToReg(p, &e, base + 2);
+
+	bool inSurroundingLoop = c->inLoop;
+	c->inLoop = true;
+	OP_position outerPendingContinueList = c->pendingContinueList;
+	c->pendingContinueList = NO_JUMP;
+	OP_position outerPendingBreakList = c->pendingBreakList;
+	emit_ABC(p, OP_FORPREP, base, cmp, 0);
+	c->pendingBreakList = emit_jump(p, OP_JUMP);
+
+	for(int i = 0; i < 5; i++)
+		advance(p);	// The increment, already checked by isCountedLoop.
+	consume(p, TOKEN_RIGHT_PAREN, "Expect ')' after for clause.");
+	OP_position loopStart = c->last_target = currentChunk(c)->count;
+	statement(p);	// Body
+
+	jump_to_here(p, c->pendingContinueList);
+	c->pendingContinueList = outerPendingContinueList;
+	if(localIsCaptured(c))
+		emit_AD(p, OP_CLOSE_UPVALUES, base, 0);
+	if(reloadLimit || ((limitSource.type == LOCAL_EXTYPE) && c->locals[limitSource.u.s.info + 1].isCaptured))
+		exprToReg(p, &limitSource, base + 1);
+	size_t line = p->previous.line;
+	p->previous.line = headerLine;	// Errors in the increment or condition belong to the loop header.
+	emit_ABC(p, OP_FORLOOP, base, cmp, 0);
+	jump_patch(p, emit_jump(p, OP_JUMP), loopStart);
+	p->previous.line = line;
+
+	endScope(p, false);
+	jump_to_here(p, c->pendingBreakList);
+	c->pendingBreakList = outerPendingBreakList;
+	c->inLoop = inSurroundingLoop;
+}
+
 static void forStatement(Parser *p) {
 	Compiler *c = p->currentCompiler;
 	consume(p, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
@@ -1854,6 +2194,11 @@ static void forStatement(Parser *p) {
 	if(match(p, TOKEN_SEMICOLON)) {
 		// no initializer.
 	} else if(match(p, TOKEN_VAR)) {
+		double step = 0;
+		if(isCountedLoop(p, &step)) {
+			countedForStatement(p, step);
+			return;
+		}
 		varDeclaration(p);
 	} else {
 		expressionStatement(p);
@@ -1883,7 +2228,7 @@ static void forStatement(Parser *p) {
 		expressionDescription e;
 		expression(p, &e);
 		consume(p, TOKEN_RIGHT_PAREN, "Expect ')' after for clause.");
-		currentChunk(c)->count = cachedCount;
+		truncateChunk(currentChunk(c), cachedCount);
 	}
 	statement(p);	// Body
 
@@ -1928,13 +2273,21 @@ static void whileStatement(Parser *p) {
 	OP_position outerPendingContinueList = p->currentCompiler->pendingContinueList;
 	p->currentCompiler->pendingContinueList = NO_JUMP;
 	OP_position outerPendingBreakList = p->currentCompiler->pendingBreakList;
-	p->currentCompiler->pendingBreakList = expressionCondition(p);
-	consume(p, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	expressionDescription cond;
+	expression(p, &cond);
+	if(ExprIsConstantHasNoJump(&cond) && !ExprIsTruthy(&cond)) {
+		p->currentCompiler->pendingBreakList = NO_JUMP;
+		consume(p, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+		deadStatement(p);
+	} else {
+		p->currentCompiler->pendingBreakList = condition(p, &cond);
+		consume(p, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-	statement(p);
+		statement(p);
 
-	jump_append(p, &p->currentCompiler->pendingContinueList, emit_jump(p, OP_JUMP));
-	jump_patch(p, p->currentCompiler->pendingContinueList, loopStart);
+		jump_append(p, &p->currentCompiler->pendingContinueList, emit_jump(p, OP_JUMP));
+		jump_patch(p, p->currentCompiler->pendingContinueList, loopStart);
+	}
 	p->currentCompiler->pendingContinueList = outerPendingContinueList;
 	p->currentCompiler->inLoop = inSurroundingLoop;
 
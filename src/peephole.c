@@ -0,0 +1,172 @@
+#include "peephole.h"
+
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+
+#define REACHABLE	0x1
+#define TARGET		0x2
+#define PAIRED		0x4		// The OP_JUMP that completes a conditional jump.
+#define REMOVED		0x8
+
+static bool isConditional(ByteCode op) {
+	return (op == OP_JUMP_IF_FALSE) || (op == OP_JUMP_IF_TRUE) ||
+		(op == OP_COPY_JUMP_IF_FALSE) || (op == OP_COPY_JUMP_IF_TRUE) ||
+		(op == OP_FORPREP) || (op == OP_FORLOOP);
+}
+
+static bool hasJump(ByteCode op) {
+	return (op == OP_JUMP) || (op == OP_BEGIN_TRY) || (op == OP_END_TRY) || (op == OP_JUMP_IF_NOT_EXC);
+}
+
+static size_t jumpTarget(Chunk *chunk, size_t pc) {
+	return pc + 1 + getJumpOffset(chunk->code[pc]);
+}
+
+static void threadJumps(Chunk *chunk) {
+	for(size_t pc = 0; pc < chunk->count; pc++) {
+		if(!hasJump(OP(chunk->code[pc])))
+			continue;
+		size_t target = jumpTarget(chunk, pc);
+		size_t steps = 0;
+		while((target != pc) && (steps++ < chunk->count) && (OP(chunk->code[target]) == OP_JUMP))
+			target = jumpTarget(chunk, target);
+		if(target != pc)	// Don't turn an infinite loop into a jump to itself.
+			setJumpOffset(&chunk->code[pc], (ptrdiff_t)target - (ptrdiff_t)pc - 1);	// Left alone if out of range.
+	}
+}
+
+static void markReachable(Chunk *chunk, uint8_t *flags, size_t *worklist, size_t *code_offsets, size_t offsetCount) {
+	size_t top = 0;
+#define PUSH(pc) \
+	do { \
+		size_t _pc = (pc); \
+		if((_pc < chunk->count) && !(flags[_pc] & REACHABLE)) { \
+			flags[_pc] |= REACHABLE; \
+			worklist[top++] = _pc; \
+		} \
+	} while(0)
+
+	PUSH(0);
+	for(size_t i = 0; i < offsetCount; i++)
+		PUSH(code_offsets[i]);
+	while(top) {
+		size_t pc = worklist[--top];
+		ByteCode op = OP(chunk->code[pc]);
+		switch(op) {
+			case OP_RETURN:
+			case OP_THROW:
+				break;
+			case OP_JUMP:
+			case OP_END_TRY:
+				PUSH(jumpTarget(chunk, pc));
+				break;
+			case OP_BEGIN_TRY:
+			case OP_JUMP_IF_NOT_EXC:
+				PUSH(jumpTarget(chunk, pc));
+				PUSH(pc + 1);
+				break;
+			default:
+				if(isConditional(op))
+					PUSH(pc + 2);
+				PUSH(pc + 1);
+				break;
+		}
+	}
+#undef PUSH
+}
+
+static void removeRedundantMoves(Chunk *chunk, uint8_t *flags) {
+	for(size_t pc = 0; pc < chunk->count; pc++) {
+		uint32_t bc = chunk->code[pc];
+		if((flags[pc] & REMOVED) || (OP(bc) != OP_MOV))
+			continue;
+		if(RA(bc) == RD(bc)) {
+			flags[pc] |= REMOVED;
+			continue;
+		}
+		if((pc + 1 == chunk->count) || (flags[pc + 1] & REMOVED) || (OP(chunk->code[pc + 1]) != OP_MOV))
+			continue;
+		uint32_t next = chunk->code[pc + 1];
+		if(RA(next) == RD(next))
+			continue;	// Removed on the next iteration.
+		if((RA(next) == RD(bc)) && (RD(next) == RA(bc)) && !(flags[pc + 1] & TARGET)) {
+			flags[pc + 1] |= REMOVED;	// Copies the value straight back.
+		} else if((RA(next) == RA(bc)) && (RD(next) != RA(bc))) {
+			flags[pc] |= REMOVED;		// Overwritten before it is read.
+		}
+	}
+}
+
+static void removeJumpsToNext(Chunk *chunk, uint8_t *flags) {
+	for(size_t pc = chunk->count; pc-- > 0;) {
+		if((flags[pc] & (REMOVED | PAIRED)) || (OP(chunk->code[pc]) != OP_JUMP))
+			continue;
+		size_t target = jumpTarget(chunk, pc);
+		if(target <= pc)
+			continue;
+		size_t i = pc + 1;
+		while((i < target) && (flags[i] & REMOVED))
+			i++;
+		if(i == target)
+			flags[pc] |= REMOVED;
+	}
+}
+
+void optimizeChunk(VM *vm, Chunk *chunk, size_t *code_offsets, size_t offsetCount) {
+	size_t count = chunk->count;
+	if(count == 0)
+		return;
+	uint8_t *flags = ALLOCATE(vm, uint8_t, count);
+	size_t *newIndex = ALLOCATE(vm, size_t, count + 1);	// Doubles as the worklist for markReachable.
+	size_t *lines = ALLOCATE(vm, size_t, count);
+	memset(flags, 0, count);
+
+	threadJumps(chunk);
+	for(size_t pc = 0; pc + 1 < count; pc++) {
+		if(isConditional(OP(chunk->code[pc])))
+			flags[++pc] |= PAIRED;
+	}
+	markReachable(chunk, flags, newIndex, code_offsets, offsetCount);
+	for(size_t pc = 0; pc < count; pc++) {
+		if(!(flags[pc] & REACHABLE)) {
+			flags[pc] |= REMOVED;
+		} else if(hasJump(OP(chunk->code[pc])) && (jumpTarget(chunk, pc) < count)) {
+			flags[jumpTarget(chunk, pc)] |= TARGET;
+		}
+	}
+	for(size_t i = 0; i < offsetCount; i++)
+		flags[code_offsets[i]] |= TARGET;
+	removeRedundantMoves(chunk, flags);
+	removeJumpsToNext(chunk, flags);
+
+	getLines(chunk, lines);
+	// A removed instruction maps to the next one that survives.
+	size_t n = 0;
+	for(size_t pc = 0; pc < count; pc++) {
+		newIndex[pc] = n;
+		if(!(flags[pc] & REMOVED))
+			n++;
+	}
+	newIndex[count] = n;
+	for(size_t pc = 0; pc < count; pc++) {
+		if(flags[pc] & REMOVED)
+			continue;
+		uint32_t bc = chunk->code[pc];
+		if(hasJump(OP(bc))) {
+			__attribute__((unused)) bool inRange = setJumpOffset(&bc, (ptrdiff_t)newIndex[jumpTarget(chunk, pc)] - (ptrdiff_t)newIndex[pc] - 1);
+			assert(inRange);	// Jumps only get shorter.
+		}
+		chunk->code[newIndex[pc]] = bc;
+		lines[newIndex[pc]] = lines[pc];
+	}
+	for(size_t i = 0; i < offsetCount; i++)
+		code_offsets[i] = newIndex[code_offsets[i]];
+	chunk->count = n;
+	setLines(vm, chunk, lines, n);
+
+	FREE_ARRAY(&vm->gc, size_t, lines, count);
+	FREE_ARRAY(&vm->gc, size_t, newIndex, count + 1);
+	FREE_ARRAY(&vm->gc, uint8_t, flags, count);
+}
@@ -0,0 +1,8 @@
+#ifndef XAN_PEEPHOLE_H
+#define XAN_PEEPHOLE_H
+
+#include "type.h"
+
+void optimizeChunk(VM *vm, Chunk *chunk, size_t *code_offsets, size_t offsetCount);
+
+#endif /* XAN_PEEPHOLE_H */
@@ -0,0 +1,242 @@
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+
+// A line of a function that allocates.  Counts and bytes are estimated from the samples.
+typedef struct {
+	char *function;		// NULL for an empty slot.
+	size_t line;
+	uint32_t hash;
+	size_t count;
+	size_t bytes;
+	size_t liveCount;
+	size_t liveBytes;
+} AllocSite;
+
+// An object that was sampled, and the bytes it stands for.
+typedef struct {
+	Obj *object;
+	size_t site;
+	size_t bytes;
+	size_t size;
+} Sample;
+
+#define SAMPLE_TOMBSTONE ((Obj*)1)
+
+struct sAllocProfile {
+	size_t interval;
+	size_t sinceSample;
+	AllocSite *sites;	// Open addressing, by function and line.
+	size_t siteCount;
+	size_t siteMask;
+	Sample *samples;	// Open addressing, by address.
+	size_t sampleCount;	// Including tombstones.
+	size_t sampleMask;
+};
+
+// Sampling doesn't touch the heap, so it can't set off a collection in the middle of an allocation.
+AllocProfile *newAllocProfile(size_t interval) {
+	AllocProfile *p = malloc(sizeof(AllocProfile));
+	p->interval = interval ? interval : 1;
+	p->sinceSample = 0;
+	p->siteCount = 0;
+	p->siteMask = 63;
+	p->sites = calloc(p->siteMask + 1, sizeof(AllocSite));
+	p->sampleCount = 0;
+	p->sampleMask = 255;
+	p->samples = calloc(p->sampleMask + 1, sizeof(Sample));
+	return p;
+}
+
+void freeAllocProfile(AllocProfile *p) {
+	if(p == NULL)
+		return;
+	for(size_t i = 0; i <= p->siteMask; i++)
+		free(p->sites[i].function);
+	free(p->sites);
+	free(p->samples);
+	free(p);
+}
+
+static size_t hashPointer(Obj *o) {
+	uintptr_t x = (uintptr_t)o;
+	x ^= x >> 17;
+	x *= 0xed5ad4bbu;
+	x ^= x >> 11;
+	return x;
+}
+
+static Sample *findSample(AllocProfile *p, Obj *o) {
+	for(size_t i = hashPointer(o);; i++) {
+		Sample *s = &p->samples[i & p->sampleMask];
+		if((s->object == o) || (s->object == NULL))
+			return s;
+	}
+}
+
+static void addSample(AllocProfile *p, Sample sample) {
+	if(4 * (p->sampleCount + 1) > 3 * (p->sampleMask + 1)) {
+		Sample *old = p->samples;
+		size_t oldMask = p->sampleMask;
+		size_t live = 0;
+		for(size_t i = 0; i <= oldMask; i++)
+			live += old[i].object > SAMPLE_TOMBSTONE;
+		// Tombstones are dropped, so the table only grows if it is filling up with live samples.
+		while(4 * (live + 1) > (p->sampleMask + 1))
+			p->sampleMask = 2 * p->sampleMask + 1;
+		p->samples = calloc(p->sampleMask + 1, sizeof(Sample));
+		p->sampleCount = live;
+		for(size_t i = 0; i <= oldMask; i++) {
+			if(old[i].object > SAMPLE_TOMBSTONE)
+				*findSample(p, old[i].object) = old[i];
+		}
+		free(old);
+	}
+	Sample *s = findSample(p, sample.object);
+	if(s->object == NULL)
+		p->sampleCount++;
+	*s = sample;
+}
+
+void profileFree(AllocProfile *p, Obj *o) {
+	Sample *s = findSample(p, o);
+	if(s->object == o)
+		s->object = SAMPLE_TOMBSTONE;
+}
+
+void profileMove(AllocProfile *p, Obj *from, Obj *to) {
+	Sample *s = findSample(p, from);
+	if(s->object != from)
+		return;
+	Sample sample = *s;
+	s->object = SAMPLE_TOMBSTONE;
+	sample.object = to;
+	addSample(p, sample);
+}
+
+static size_t findSite(AllocProfile *p, const char *function, size_t line, uint32_t hash) {
+	for(size_t i = hash;; i++) {
+		AllocSite *site = &p->sites[i & p->siteMask];
+		if((site->function == NULL) || ((site->hash == hash) && (site->line == line) && (strcmp(site->function, function) == 0)))
+			return i & p->siteMask;
+	}
+}
+
+static size_t addSite(AllocProfile *p, const char *function, size_t line) {
+	uint32_t hash = 2166136261u;
+	for(const char *c = function; *c; c++) {
+		hash ^= (uint8_t)*c;
+		hash *= 16777619;
+	}
+	hash ^= (uint32_t)line * 0x9e3779b9u;
+	size_t i = findSite(p, function, line, hash);
+	if(p->sites[i].function)
+		return i;
+	if(4 * (p->siteCount + 1) > 3 * (p->siteMask + 1)) {
+		// Samples refer to sites by index, so they are renumbered as the sites move.
+		AllocSite *old = p->sites;
+		size_t oldMask = p->siteMask;
+		p->siteMask = 2 * p->siteMask + 1;
+		p->sites = calloc(p->siteMask + 1, sizeof(AllocSite));
+		size_t *moved = malloc(sizeof(size_t) * (oldMask + 1));
+		for(size_t j = 0; j <= oldMask; j++) {
+			if(old[j].function) {
+				moved[j] = findSite(p, old[j].function, old[j].line, old[j].hash);
+				p->sites[moved[j]] = old[j];
+			}
+		}
+		for(size_t j = 0; j <= p->sampleMask; j++) {
+			if(p->samples[j].object > SAMPLE_TOMBSTONE)
+				p->samples[j].site = moved[p->samples[j].site];
+		}
+		free(moved);
+		free(old);
+		i = findSite(p, function, line, hash);
+	}
+	AllocSite *site = &p->sites[i];
+	site->function = strdup(function);
+	site->line = line;
+	site->hash = hash;
+	p->siteCount++;
+	return i;
+}
+
+// The instruction that allocated is the one the innermost Xan frame was running when it last called out of the interpreter.
+static size_t currentSite(AllocProfile *p, VM *vm) {
+	thread *t = vm->baseThread;
+	Value *base = t ? t->base : NULL;
+	while(base && (base > t->stack) && !IS_CLOSURE(base[-3]))
+		base -= AS_IP(base[-2]);
+	if((base == NULL) || (base <= t->stack))
+		return addSite(p, "(native)", 0);
+	ObjFunction *f = AS_CLOSURE(base[-3])->f;
+	const char *name = f->name ? f->name->chars : "script";
+	if((t->ip <= f->chunk.code) || (t->ip > f->chunk.code + f->chunk.count))
+		return addSite(p, name, 0);		// It hasn't called out since it was entered.
+	return addSite(p, name, getLine(&f->chunk, t->ip - f->chunk.code - 1));
+}
+
+void profileAllocation(VM *vm, Obj *o, size_t size) {
+	AllocProfile *p = vm->gc.profile;
+	p->sinceSample += size;
+	if(p->sinceSample < p->interval)
+		return;
+	size_t bytes = p->sinceSample;
+	p->sinceSample = 0;
+	size_t site = currentSite(p, vm);
+	p->sites[site].count += bytes / size;
+	p->sites[site].bytes += bytes;
+	addSample(p, (Sample){o, site, bytes, size});
+}
+
+void profileAllocations(VM *vm, size_t interval) {
+	freeAllocProfile(vm->gc.profile);
+	vm->gc.profile = newAllocProfile(interval);
+}
+
+static int compareSites(const void *a, const void *b) {
+	const AllocSite *x = *(const AllocSite* const*)a;
+	const AllocSite *y = *(const AllocSite* const*)b;
+	if(x->bytes != y->bytes)
+		return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+	return (x->liveBytes < y->liveBytes) - (x->liveBytes > y->liveBytes);
+}
+
+void printAllocProfile(VM *vm) {
+	AllocProfile *p = vm->gc.profile;
+	if(p == NULL)
+		return;
+	// Whatever is still sampled after a full collection is reachable.
+	collectAll(vm);
+	for(size_t i = 0; i <= p->siteMask; i++) {
+		p->sites[i].liveCount = 0;
+		p->sites[i].liveBytes = 0;
+	}
+	for(size_t i = 0; i <= p->sampleMask; i++) {
+		Sample *s = &p->samples[i];
+		if(s->object > SAMPLE_TOMBSTONE) {
+			p->sites[s->site].liveCount += s->bytes / s->size;
+			p->sites[s->site].liveBytes += s->bytes;
+		}
+	}
+	AllocSite **sorted = malloc(sizeof(AllocSite*) * (p->siteCount + 1));
+	size_t n = 0;
+	for(size_t i = 0; i <= p->siteMask; i++) {
+		if(p->sites[i].function)
+			sorted[n++] = &p->sites[i];
+	}
+	qsort(sorted, n, sizeof(AllocSite*), compareSites);
+	fprintf(stderr, "Allocations, sampled every %zu bytes:\n", p->interval);
+	fprintf(stderr, "%12s %10s %12s %10s  %s\n", "bytes", "objects", "live bytes", "live", "site");
+	for(size_t i = 0; i < n; i++) {
+		AllocSite *site = sorted[i];
+		fprintf(stderr, "%12zu %10zu %12zu %10zu  %s:%zu\n", site->bytes, site->count, site->liveBytes, site->liveCount, site->function, site->line);
+	}
+	free(sorted);
+}
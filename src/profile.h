@@ -0,0 +1,14 @@
+#ifndef XAN_PROFILE_H
+#define XAN_PROFILE_H
+
+#include "type.h"
+
+// The allocation profiler samples an object every interval bytes, and charges the bytes allocated since the last sample to the line that allocated it.
+// Sampled objects are followed until they are freed, so the objects that survive can be counted by the line that made them.
+AllocProfile *newAllocProfile(size_t interval);
+void freeAllocProfile(AllocProfile *p);
+void profileAllocation(VM *vm, Obj *o, size_t size);
+void profileFree(AllocProfile *p, Obj *o);
+void profileMove(AllocProfile *p, Obj *from, Obj *to);
+
+#endif /* XAN_PROFILE_H */
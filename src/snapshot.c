@@ -0,0 +1,296 @@
+#include "memory.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exception.h"
+#include "object.h"
+#include "table.h"
+
+/**********************************************************************************
+  A snapshot is a text file with a line for each object reachable from the roots:
+
+	xan-heap 1
+	roots <id>...
+	<id> <type> <size> <label> <id>...
+
+  Objects are numbered in the order they are found.  The size is the object and the
+  buffers it owns, and the label is the name of its class or function, or "-".  The
+  ids that follow are the objects it refers to.  References that a weak table holds
+  weakly aren't listed, since they don't keep anything alive.  util/heap.py reads it.
+ **********************************************************************************/
+
+typedef struct {
+	Obj *object;	// NULL for an empty slot.
+	size_t id;
+} SeenObject;
+
+// The walk is separate from the collector's marking, so it can't disturb a cycle in progress.
+typedef struct {
+	FILE *file;
+	SeenObject *seen;	// Open addressing, by address.
+	size_t seenCount;
+	size_t seenMask;
+	Obj **stack;		// Objects that have been numbered, but not written.
+	size_t stackCount;
+	size_t stackCapacity;
+} Snapshot;
+
+static size_t hashObject(Obj *o) {
+	uintptr_t x = (uintptr_t)o;
+	x ^= x >> 17;
+	x *= 0xed5ad4bbu;
+	x ^= x >> 11;
+	return x;
+}
+
+static SeenObject *findSeen(Snapshot *s, Obj *o) {
+	for(size_t i = hashObject(o);; i++) {
+		SeenObject *entry = &s->seen[i & s->seenMask];
+		if((entry->object == o) || (entry->object == NULL))
+			return entry;
+	}
+}
+
+// Returns the id of an object, and queues it to be written the first time it is seen.
+static size_t visit(Snapshot *s, Obj *o) {
+	if(4 * (s->seenCount + 1) > 3 * (s->seenMask + 1)) {
+		SeenObject *old = s->seen;
+		size_t oldMask = s->seenMask;
+		s->seenMask = 2 * s->seenMask + 1;
+		s->seen = calloc(s->seenMask + 1, sizeof(SeenObject));
+		for(size_t i = 0; i <= oldMask; i++) {
+			if(old[i].object)
+				*findSeen(s, old[i].object) = old[i];
+		}
+		free(old);
+	}
+	SeenObject *entry = findSeen(s, o);
+	if(entry->object)
+		return entry->id;
+	*entry = (SeenObject){o, s->seenCount++};
+	if(s->stackCapacity < s->stackCount + 1) {
+		s->stackCapacity = GROW_CAPACITY(s->stackCapacity);
+		s->stack = realloc(s->stack, sizeof(Obj*) * s->stackCapacity);
+	}
+	s->stack[s->stackCount++] = o;
+	return entry->id;
+}
+
+static void edge(Snapshot *s, Obj *o) {
+	if(o)
+		fprintf(s->file, " %zu", visit(s, o));
+}
+
+static void edgeValue(Snapshot *s, Value v) {
+	if(IS_OBJ(v))
+		edge(s, AS_OBJ(v));
+}
+
+static const char *className(ObjClass *klass) {
+	if(klass && klass->name)
+		return klass->name->chars;
+	return (klass && klass->cname) ? klass->cname : "-";
+}
+
+static const char *label(Obj *o) {
+	switch(o->type) {
+		case OBJ_ARRAY:		return className(((ObjArray*)o)->klass);
+		case OBJ_CLASS:		return className((ObjClass*)o);
+		case OBJ_CLOSURE:	o = (Obj*)((ObjClosure*)o)->f;	// Fall through.
+		case OBJ_FUNCTION: {
+			ObjString *name = ((ObjFunction*)o)->name;
+			return name ? name->chars : "script";
+		}
+		case OBJ_INSTANCE:	return className(((ObjInstance*)o)->klass);
+		case OBJ_MODULE:	return ((ObjModule*)o)->name ? ((ObjModule*)o)->name->chars : "-";
+		case OBJ_EXCEPTION:	return className(((ObjException*)o)->klass);
+		default:			return "-";
+	}
+}
+
+// Module names come from import, so they might have spaces.
+static void writeLabel(FILE *file, const char *label) {
+	if(*label == '\0')
+		label = "-";
+	for(const char *c = label; *c; c++)
+		fputc(isspace((unsigned char)*c) ? '_' : *c, file);
+}
+
+// The object itself, and the buffers that are freed with it.
+static size_t selfBytes(Obj *o) {
+	size_t size = objectSize(o);
+	switch(o->type) {
+		case OBJ_ARRAY: {
+			ObjArray *array = (ObjArray*)o;
+			if(array->capacity)
+				size += slotsSize(array->capacity);
+			break;
+		}
+		case OBJ_CLOSURE:
+			size += ((ObjClosure*)o)->uvCount * sizeof(ObjUpvalue*);
+			break;
+		case OBJ_FUNCTION: {
+			Chunk *chunk = &((ObjFunction*)o)->chunk;
+			size += chunk->capacity * sizeof(uint32_t) + chunk->lineInfoCapacity;
+			break;
+		}
+		case OBJ_TABLE: {
+			size_t slots = tableSlots((ObjTable*)o);
+			if(slots)
+				size += slotsSize(slots);
+			break;
+		}
+		case OBJ_THREAD: {
+			thread *t = (thread*)o;
+			if(t->stack)
+				size += (t->stackLast - t->stack + 1) * sizeof(Value);
+			break;
+		}
+		default:
+			break;
+	}
+	return size;
+}
+
+// The same references blackenObject follows.
+static void writeEdges(Snapshot *s, Obj *o) {
+	switch(o->type) {
+		case OBJ_ARRAY: {
+			ObjArray *array = (ObjArray*)o;
+			edge(s, (Obj*)array->klass);
+			edge(s, (Obj*)array->fields);
+			for(size_t i = 0; i < array->count; i++)
+				edgeValue(s, array->values[i]);
+			break;
+		}
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod *bound = (ObjBoundMethod*)o;
+			edgeValue(s, bound->receiver);
+			edge(s, (Obj*)bound->method);
+			break;
+		}
+		case OBJ_CLASS: {
+			ObjClass *klass = (ObjClass*)o;
+			edge(s, (Obj*)klass->name);
+			edge(s, (Obj*)klass->methods);
+			break;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure *cl = (ObjClosure*)o;
+			edge(s, (Obj*)cl->f);
+			for(size_t i = 0; i < cl->uvCount; i++)
+				edge(s, (Obj*)cl->upvalues[i]);
+			break;
+		}
+		case OBJ_FUNCTION: {
+			ObjFunction *f = (ObjFunction*)o;
+			edge(s, (Obj*)f->name);
+			edge(s, (Obj*)f->chunk.constants);
+			edge(s, (Obj*)f->chunk.constantIndices);
+			break;
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance *instance = (ObjInstance*)o;
+			edge(s, (Obj*)instance->klass);
+			edge(s, (Obj*)instance->fields);
+			break;
+		}
+		case OBJ_MODULE: {
+			ObjModule *module = (ObjModule*)o;
+			edge(s, (Obj*)module->name);
+			edge(s, (Obj*)module->fields);
+			edge(s, (Obj*)module->klass);
+			break;
+		}
+		case OBJ_TABLE: {
+			ObjTable *t = (ObjTable*)o;
+			Value key, value;
+			for(size_t i = 0; tableNext(t, &i, &key, &value);) {
+				if(!weakKeys(t))
+					edgeValue(s, key);
+				if(!weakValues(t))
+					edgeValue(s, value);
+			}
+			break;
+		}
+		case OBJ_UPVALUE:
+			edgeValue(s, ((ObjUpvalue*)o)->closed);
+			break;
+		case OBJ_EXCEPTION: {
+			ObjException *e = (ObjException*)o;
+			edge(s, (Obj*)e->klass);
+			edge(s, (Obj*)e->fields);
+			edgeValue(s, e->msg);
+			break;
+		}
+		case OBJ_STRING: {
+			ObjString *string = (ObjString*)o;
+			edge(s, (Obj*)string->klass);
+			edge(s, (Obj*)string->fields);
+			break;
+		}
+		case OBJ_ROPE: {
+			ObjRope *rope = (ObjRope*)o;
+			edge(s, rope->left);
+			edge(s, rope->right);
+			break;
+		}
+		case OBJ_THREAD: {
+			// Frame markers aren't objects, so the whole stack can be read as values.
+			thread *t = (thread*)o;
+			for(Value *slot = t->stack; slot && (slot < t->stackTop); slot++)
+				edgeValue(s, *slot);
+			edgeValue(s, t->exception);
+			for(ObjUpvalue *u = t->openUpvalues; u != NULL; u = u->next)
+				edge(s, (Obj*)u);
+			for(Compiler *c = t->currentCompiler; c != NULL; c = c->enclosing) {
+				edge(s, (Obj*)c->name);
+				edge(s, (Obj*)c->chunk.constants);
+				edge(s, (Obj*)c->chunk.constantIndices);
+			}
+			for(ClassCompiler *c = t->currentClassCompiler; c != NULL; c = c->enclosing)
+				edge(s, (Obj*)c->methods);
+			break;
+		}
+		case OBJ_NATIVE:
+			break;
+	}
+}
+
+bool writeHeapSnapshot(VM *vm, const char *path) {
+	Snapshot s = {fopen(path, "w"), NULL, 0, 1023, NULL, 0, 0};
+	if(s.file == NULL)
+		return false;
+	s.seen = calloc(s.seenMask + 1, sizeof(SeenObject));
+
+	// The roots that markRoots marks.
+	fprintf(s.file, "xan-heap 1\nroots");
+	edge(&s, (Obj*)vm->initString);
+	edge(&s, (Obj*)vm->newString);
+	for(int c = 0; c < 256; c++)
+		edge(&s, (Obj*)vm->characters[c]);
+	edge(&s, (Obj*)vm->globals);
+	edge(&s, (Obj*)vm->builtinMods);
+	edge(&s, (Obj*)vm->strings);
+	edge(&s, (Obj*)vm->baseThread);
+	fprintf(s.file, "\n");
+
+	while(s.stackCount > 0) {
+		Obj *o = s.stack[--s.stackCount];
+		const char *type = ObjTypeNames[o->type] + strlen("OBJ_");
+		fprintf(s.file, "%zu ", findSeen(&s, o)->id);
+		for(const char *c = type; *c; c++)
+			fputc(tolower((unsigned char)*c), s.file);
+		fprintf(s.file, " %zu ", selfBytes(o));
+		writeLabel(s.file, label(o));
+		writeEdges(&s, o);
+		fprintf(s.file, "\n");
+	}
+
+	free(s.seen);
+	free(s.stack);
+	return fclose(s.file) == 0;
+}
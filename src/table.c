@@ -5,6 +5,7 @@
 
 #include "class.h"
 #include "exception.h"
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 
@@ -18,32 +19,51 @@
 
 struct sObjTable {
 	INSTANCE_FIELDS;
-	size_t count;
+	size_t count;	// Including tombstones, for the load factor.
+	size_t live;	// The entries that aren't tombstones.
 	size_t capacityMask;
 	Value *entries;
 };
+#if UINTPTR_MAX == UINT64_MAX
+XAN_STATIC_ASSERT(sizeof(ObjTable) == 56);
+#endif
 
 #define KEY(e) e[0]
 #define VALUE(e) e[1]
 
+// String keys are interned, so they can be compared by address.
 static uint32_t hash(Value v) {
 	assert(IS_STRING(v) || IS_NUMBER(v));
-	if(IS_STRING(v))
+	if(IS_STRING(v)) {
+		assert(AS_STRING(v)->interned);
 		return AS_STRING(v)->hash;
+	}
 	assert(IS_NUMBER(v));
-	if((double)(int64_t)AS_NUMBER(v) == AS_NUMBER(v))
-		return (uint32_t)(int64_t)AS_NUMBER(v);
-	union {double x; uint64_t i;}temp;
-	temp.x = AS_NUMBER(v);
-	return (temp.i & 0xffffffff) ^ (temp.i >> 32);
+	return hashNumber(AS_NUMBER(v));
 }
 
-bool TableInit(VM *vm, thread *currentThread, int argCount) {
+// Weak tables are the only tables with a class, which sets how they hold their entries.
+bool weakKeys(ObjTable *t) {
+	return (t->klass == &weakKeyTableDef) || (t->klass == &ephemeronTableDef);
+}
+
+bool weakValues(ObjTable *t) {
+	return t->klass == &weakValueTableDef;
+}
+
+bool isWeakTable(ObjTable *t) {
+	return weakKeys(t) || weakValues(t);
+}
+
+static bool initTable(VM *vm, thread *currentThread, int argCount, ObjClass *klass) {
 	assert((argCount & 1) == 0);
 
 	incCFrame(vm, currentThread, 1, argCount + 3);
 	ObjTable *t = newTable(vm, currentThread, argCount);
 	decCFrame(currentThread);
+	t->klass = klass;
+	if(weakKeys(t))
+		vm->gc.weakKeyTables = true;
 	currentThread->base[-1] = OBJ_VAL(t);
 
 	for(int i = 0; i<argCount; i+=2) {
@@ -55,6 +75,22 @@ bool TableInit(VM *vm, thread *currentThread, int argCount) {
 	return true;
 }
 
+bool TableInit(VM *vm, thread *currentThread, int argCount) {
+	return initTable(vm, currentThread, argCount, NULL);
+}
+
+static bool WeakKeyTableInit(VM *vm, thread *currentThread, int argCount) {
+	return initTable(vm, currentThread, argCount, &weakKeyTableDef);
+}
+
+static bool WeakValueTableInit(VM *vm, thread *currentThread, int argCount) {
+	return initTable(vm, currentThread, argCount, &weakValueTableDef);
+}
+
+static bool EphemeronTableInit(VM *vm, thread *currentThread, int argCount) {
+	return initTable(vm, currentThread, argCount, &ephemeronTableDef);
+}
+
 static Value* findEntry(Value *entries, size_t capacityMask, Value key) {
 	assert(IS_STRING(key) || IS_NUMBER(key));
 	uint32_t index = hash(key) & (capacityMask - 1);	// Even, i.e. key
@@ -93,7 +129,7 @@ bool tableGet(ObjTable *t, Value key, Value *ret) {
 }
 
 static void adjustCapacity(VM *vm, ObjTable *t, size_t capacityMask) {
-	Value *entries = ALLOCATE(vm, Value, capacityMask + 1);
+	Value *entries = ALLOCATE_SLOTS(vm, capacityMask + 1);
 	for(size_t i=0; i<=capacityMask; i++)
 		entries[i] = NIL_VAL;
 
@@ -107,16 +143,30 @@ static void adjustCapacity(VM *vm, ObjTable *t, size_t capacityMask) {
 		VALUE(dest) = VALUE(e);
 		t->count++;
 	}
+	t->live = t->count;
 
-	if(t->capacityMask)
-		FREE_ARRAY(&vm->gc, Value, t->entries, t->capacityMask + 1);
-	t->entries = entries;
-	t->capacityMask = capacityMask;
+	if(t->capacityMask) {
+		// The marker thread may read the new entries with the old capacityMask, and miss some of them.
+		if(vm->gc.concurrent && !isWeakTable(t)) {
+			for(size_t i=0; i<=t->capacityMask; i++)
+				logOverwrite(&vm->gc, t->entries[i]);
+		}
+		FREE_SLOTS(&vm->gc, t->entries, t->capacityMask + 1);
+	}
+	STORE_RELEASE(&t->entries, entries);
+	STORE_RELEASE(&t->capacityMask, capacityMask);
+}
+
+ObjTable *newWeakTable(VM *vm, thread *currentThread, size_t count, ObjClass *klass) {
+	ObjTable *t = newTable(vm, currentThread, count);
+	t->klass = klass;
+	return t;
 }
 
 ObjTable *newTable(VM *vm, thread *currentThread, size_t count) {
 	ObjTable *t = ALLOCATE_OBJ(vm, ObjTable, OBJ_TABLE);
 	t->count = 0;
+	t->live = 0;
 	t->capacityMask = 0;
 	t->entries = NULL;
 	t->klass = NULL;
@@ -148,8 +198,13 @@ static bool TableNew(VM *vm, thread *currentThread, int argCount) {
 }
 
 bool tableSet(VM *vm, ObjTable *t, Value key, Value value) {
+	if(IS_STRING(key))
+		key = OBJ_VAL(internString(vm, AS_STRING(key)));
 	if(t->count + 1 > (t->capacityMask / 2) * TABLE_MAX_LOAD) {
-		size_t capacity = GROW_CAPACITY(t->capacityMask + 1);
+		// count includes tombstones.  If they are most of the load, rehashing at the same size drops them, so a table that is deleted from as much as it is added to stops growing.
+		size_t capacity = t->capacityMask + 1;
+		if(2 * (t->live + 1) > (t->capacityMask / 2) * TABLE_MAX_LOAD)
+			capacity = GROW_CAPACITY(capacity);
 		assert(capacity >= 1);
 		adjustCapacity(vm, t, capacity-1);
 	}
@@ -159,10 +214,13 @@ bool tableSet(VM *vm, ObjTable *t, Value key, Value value) {
 	bool isNewKey = IS_NIL(*e);
 	if(isNewKey && IS_NIL(VALUE(e)))
 		t->count++;
+	if(isNewKey)
+		t->live++;
 
-	writeBarrier(vm, t);
+	satbBarrier(vm, VALUE(e));
 	KEY(e) = key;
 	VALUE(e) = value;
+	slotBarrier(vm, (Obj*)t, t->entries, t->capacityMask + 1, e - t->entries);
 	return isNewKey;
 }
 
@@ -178,6 +236,7 @@ bool tableDelete(ObjTable *t, Value key) {
 	// Place a tombstone in the entry.
 	*e = NIL_VAL;
 	VALUE(e) = BOOL_VAL(true);
+	t->live--;
 
 	return true;
 }
@@ -212,7 +271,7 @@ ObjString *tableFindString(ObjTable *t, const char *chars, size_t length, uint32
 }
 
 void fprintTable(FILE *restrict stream, ObjTable *t) {
-	if(t->count == 0) {
+	if(t->live == 0) {
 		fprintf(stream, "{}");
 		return;
 	}
@@ -241,28 +300,124 @@ ObjTable *duplicateTable(VM *vm, thread *currentThread, ObjTable *source) {
 }
 
 size_t count(ObjTable *t) {
-	return t->count;
+	return t->live;
 }
 
-void markTable(GarbageCollector *gc, ObjTable *t) {
-	for(size_t i=1; i<=t->capacityMask; i+=2) {
-		Value *e = &t->entries[i-1];
-		markValue(gc, KEY(e));
-		markValue(gc, VALUE(e));
+size_t tableSlots(ObjTable *t) {
+	return t->entries ? t->capacityMask + 1 : 0;
+}
+
+// Steps through the entries of a table, starting from *i = 0.  Returns false once there are none left.
+bool tableNext(ObjTable *t, size_t *i, Value *key, Value *value) {
+	for(; *i < tableSlots(t); *i += 2) {
+		if(!IS_NIL(t->entries[*i])) {
+			*key = t->entries[*i];
+			*value = t->entries[*i + 1];
+			*i += 2;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool isWhiteValue(GarbageCollector *gc, Value v) {
+	return IS_OBJ(v) && isWhite(gc, AS_OBJ(v));
+}
+
+// Whether the card of a weak table starting at the given slot can hold a white object.
+// Once the table has been cleared in this cycle, the objects it held have been marked, so only the cards stored to since can.
+static bool weakCard(GarbageCollector *gc, Value *entries, size_t capacityMask, size_t slot) {
+	if(!hasCards(capacityMask + 1))
+		return true;
+	CardTable *cards = cardsOf(entries, capacityMask + 1);
+	return (cards->epoch != gc->cardEpoch) || cards->dirty[slot / GC_CARD_SIZE];
+}
+
+static size_t cardEnd(size_t capacityMask, size_t slot) {
+	return (slot + GC_CARD_SIZE <= capacityMask) ? slot + GC_CARD_SIZE : capacityMask + 1;
+}
+
+// A weak table only marks what it holds strongly, and is cleared once marking is done.  An ephemeron's value is marked once its key is.
+static void markWeakTable(GrayStack *s, ObjTable *t, Value *entries, size_t capacityMask) {
+	markValue(s, OBJ_VAL(t->klass));
+	if(t == s->gc->strings)
+		return;	// It holds nothing strongly, and freeing a string removes it, so there is nothing to clear either.
+	pushObject(&s->weak, (Obj*)t);
+	for(size_t card = 0; card <= capacityMask; card += GC_CARD_SIZE) {
+		// The workers scan every card, since the program is dirtying them.
+		if(!s->shared && !weakCard(s->gc, entries, capacityMask, card))
+			continue;
+		for(size_t i = card; i < cardEnd(capacityMask, card); i += 2) {
+			Value *e = &entries[i];
+			// A minor collection doesn't trace the old strings, and one of them may equal a young key.  So keys are only let go by major cycles.
+			if(!weakKeys(t) || (s->gc->phase != GC_MARK))
+				markValue(s, KEY(e));
+			if((t->klass == &weakKeyTableDef) || ((t->klass == &ephemeronTableDef) && !isWhiteValue(s->gc, KEY(e))))
+				markValue(s, VALUE(e));
+		}
 	}
 }
 
-void tableRemoveWhite(ObjTable *t) {
+void markTable(GrayStack *s, ObjTable *t) {
+	size_t capacityMask = LOAD_ACQUIRE(&t->capacityMask);
+	Value *entries = LOAD_ACQUIRE(&t->entries);
+	if(isWeakTable(t))
+		markWeakTable(s, t, entries, capacityMask);
+	else if(capacityMask)
+		markSlots(s, entries, capacityMask + 1, capacityMask + 1);	// Cards hold whole entries, since GC_CARD_SIZE is even.
+}
+
+// Marks the values of an ephemeron table whose keys have been marked since it was blackened.  Returns true if that found anything new.
+bool markEphemeron(GrayStack *s, ObjTable *t) {
+	if(t->klass != &ephemeronTableDef)
+		return false;
+	size_t count = s->count;
+	for(size_t card = 0; card <= t->capacityMask; card += GC_CARD_SIZE) {
+		if(!weakCard(s->gc, t->entries, t->capacityMask, card))
+			continue;
+		for(size_t i = card; i < cardEnd(t->capacityMask, card); i += 2) {
+			Value *e = &t->entries[i];
+			if(!IS_NIL(KEY(e)) && !isWhiteValue(s->gc, KEY(e)))
+				markValue(s, VALUE(e));
+		}
+	}
+	return s->count > count;
+}
+
+// Keys are hashed by value, so moving them doesn't change where they go.
+void forwardTable(ObjTable *t) {
 	for(size_t i=1; i<=t->capacityMask; i+=2) {
 		Value *e = &t->entries[i-1];
-		if(!IS_NIL(*e) && isWhite(AS_OBJ(*e)))
-			tableDelete(t, KEY(e));
+		forwardValue(&KEY(e));
+		forwardValue(&VALUE(e));
+	}
+}
+
+// Removes the entries of a weak table that hold an object that wasn't marked.
+void tableRemoveWhite(GarbageCollector *gc, ObjTable *t) {
+	for(size_t card = 0; card <= t->capacityMask; card += GC_CARD_SIZE) {
+		if(!weakCard(gc, t->entries, t->capacityMask, card))
+			continue;
+		for(size_t i = card; i < cardEnd(t->capacityMask, card); i += 2) {
+			Value *e = &t->entries[i];
+			if(IS_NIL(*e))
+				continue;
+			if((weakKeys(t) && isWhiteValue(gc, KEY(e))) || (weakValues(t) && isWhiteValue(gc, VALUE(e))))
+				tableDelete(t, KEY(e));
+		}
+	}
+	if(hasCards(t->capacityMask + 1)) {
+		CardTable *cards = cardsOf(t->entries, t->capacityMask + 1);
+		cards->epoch = gc->cardEpoch;
+		memset(cards->dirty, 0, cardCount(t->capacityMask + 1));
 	}
 }
 
+const size_t tableObjectSize = sizeof(ObjTable);
+
 void freeTable(GarbageCollector *gc, ObjTable *t) {
 	if(t->capacityMask)
-		FREE_ARRAY(gc, Value, t->entries, t->capacityMask+1);
+		FREE_SLOTS(gc, t->entries, t->capacityMask+1);
 	FREE(gc, ObjTable, t);
 }
 
@@ -279,3 +434,45 @@ ObjClass tableDef = {
 	RUNTIME_CLASSDEF_FIELDS,
 	false
 };
+
+NativeDef weakKeyTableMethods[] = {
+	{"init", &WeakKeyTableInit},
+	{NULL, NULL}
+};
+
+// Its entries are removed once nothing else refers to their keys.
+ObjClass weakKeyTableDef = {
+	CLASS_HEADER,
+	"WeakKeyTable",
+	weakKeyTableMethods,
+	RUNTIME_CLASSDEF_FIELDS,
+	false
+};
+
+NativeDef weakValueTableMethods[] = {
+	{"init", &WeakValueTableInit},
+	{NULL, NULL}
+};
+
+// Its entries are removed once nothing else refers to their values.
+ObjClass weakValueTableDef = {
+	CLASS_HEADER,
+	"WeakValueTable",
+	weakValueTableMethods,
+	RUNTIME_CLASSDEF_FIELDS,
+	false
+};
+
+NativeDef ephemeronTableMethods[] = {
+	{"init", &EphemeronTableInit},
+	{NULL, NULL}
+};
+
+// Like a WeakKeyTable, except that a value only keeps anything alive while its key is alive, so a value that refers to its own key doesn't keep the entry.
+ObjClass ephemeronTableDef = {
+	CLASS_HEADER,
+	"EphemeronTable",
+	ephemeronTableMethods,
+	RUNTIME_CLASSDEF_FIELDS,
+	false
+};
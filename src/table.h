@@ -6,6 +6,10 @@
 #include <stdio.h>
 
 ObjTable *newTable(VM *vm, thread *currentThread, size_t count);
+ObjTable *newWeakTable(VM *vm, thread *currentThread, size_t count, ObjClass *klass);
+bool isWeakTable(ObjTable *t);
+bool weakKeys(ObjTable *t);
+bool weakValues(ObjTable *t);
 bool tableGet(ObjTable *t, Value key, Value *value);
 bool tableSet(VM *vm, ObjTable *t, Value key, Value value);
 bool tableDelete(ObjTable *t, Value key);
@@ -14,11 +18,19 @@ ObjString *tableFindString(ObjTable *t, const char *chars, size_t length, uint32
 void fprintTable(FILE *restrict stream, ObjTable *t);
 ObjTable *duplicateTable(VM *vm, thread *currentThread, ObjTable *source);
 
-void tableRemoveWhite(ObjTable *t);
-void markTable(GarbageCollector *gc, ObjTable *t);
+void tableRemoveWhite(GarbageCollector *gc, ObjTable *t);
+void markTable(GrayStack *s, ObjTable *t);
+bool markEphemeron(GrayStack *s, ObjTable *t);
+void forwardTable(ObjTable *t);
 void freeTable(GarbageCollector *gc, ObjTable *t);
+extern const size_t tableObjectSize;	// ObjTable is only defined in table.c.
 size_t count(ObjTable *t);
+size_t tableSlots(ObjTable *t);
+bool tableNext(ObjTable *t, size_t *i, Value *key, Value *value);
 
 extern ObjClass tableDef;
+extern ObjClass weakKeyTableDef;
+extern ObjClass weakValueTableDef;
+extern ObjClass ephemeronTableDef;
 
 #endif /* XAN_TABLE_H */
@@ -4,6 +4,7 @@
 #include "common.h"
 #include "scanner.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -25,7 +26,8 @@
 	X(BOUND_METHOD)SEP \
 	X(TABLE)SEP \
 	X(THREAD)SEP \
-	X(EXCEPTION)
+	X(EXCEPTION)SEP \
+	X(ROPE)
 
 typedef enum {
 #define ENUM_BUILDER(x) OBJ_##x
@@ -34,6 +36,12 @@ typedef enum {
 #undef ENUM_BUILDER
 } ObjType;
 
+enum {
+#define ONE_BUILDER(x) 1
+	OBJ_TYPE_COUNT = OBJ_BUILDER(ONE_BUILDER, +)
+#undef ONE_BUILDER
+};
+
 typedef uint8_t Reg;			// a register, i.e. a stack offset.
 typedef uint32_t OP_position;	// an index into a bytecode array.
 
@@ -43,12 +51,14 @@ static const char* const ObjTypeNames[] = {
 #undef STRING_BUILDER
 };
 
+// The header fits in a word.  The garbage collector finds objects through its page bitmaps and object vectors, rather than a link in each object.
 struct sObj {
-	ObjType type;
-	bool isBlack;
+	uint8_t type;	// An ObjType.
+	bool mark;		// The object is black when this matches GarbageCollector.blackMark.  Objects in the arena use their page's bitmap instead.
 	bool isGrey;
-	struct sObj *next;
+	bool inArena;
 };
+XAN_STATIC_ASSERT(sizeof(Obj) <= sizeof(void*));
 
 #ifdef TAGGED_NAN
 XAN_STATIC_ASSERT(sizeof(double) == sizeof(uint64_t));
@@ -96,19 +106,32 @@ typedef struct {
 	Value *values;
 } ObjArray;
 
-// TODO turn chars into a flexible array member to optimize by minimizing allocations.
+// The characters follow the header in the same allocation, with a '\0' after them.
 struct sObjString {
 	INSTANCE_FIELDS;
 	size_t length;
-	uint32_t hash;
-	char *chars;
+	uint32_t hash;		// Only set once it is interned.
+	bool interned;
+	char chars[];
 };
 
+// A concatenation whose characters haven't been copied yet.  left and right are each a string or a rope.
+// Once it has been flattened, left is the interned string and right is NULL.
+typedef struct {
+	Obj obj;
+	size_t length;
+	Obj *left;
+	Obj *right;
+} ObjRope;
+
 typedef struct {
 	size_t count;
 	size_t capacity;
 	uint32_t *code;
-	size_t *lines;
+	uint8_t *lineInfo;	// Runs of (zigzag varint line delta, instruction count byte).
+	size_t lineInfoCount;
+	size_t lineInfoCapacity;
+	size_t lastLine;
 	ObjArray *constants;
 	ObjTable *constantIndices;
 } Chunk;
@@ -117,8 +140,8 @@ typedef struct {
 	Obj obj;
 	int minArity;
 	int maxArity;
-	size_t uvCount;
 	Reg stackUsed;
+	size_t uvCount;
 	Chunk chunk;
 	ObjString *name;
 	size_t *code_offsets;
@@ -156,6 +179,8 @@ typedef struct {
 	Token name;
 	int depth;
 	bool isCaptured;
+	bool isConstant;	// Never reassigned, so reads can use constant instead of the register.
+	Value constant;
 } Local;
 
 typedef enum {
@@ -165,6 +190,14 @@ typedef enum {
 	TYPE_SCRIPT,
 } FunctionType;
 
+// The names assigned to from where a scope's first constant local is declared to the end of its block, sorted.
+typedef struct AssignedNames {
+	struct AssignedNames *enclosing;
+	int depth;
+	Token *names;
+	size_t count;
+} AssignedNames;
+
 typedef struct Compiler {
 	struct Compiler *enclosing;
 	ObjString *name;
@@ -178,6 +211,7 @@ typedef struct Compiler {
 	int maxArity;
 	ObjArray *defaultArgs;
 	int scopeDepth;
+	AssignedNames *assigned;	// Scanned at most once for each scope.
 	OP_position pendingJumpList;
 	OP_position pendingBreakList;
 	OP_position pendingContinueList;
@@ -208,6 +242,7 @@ typedef struct {
 	Value *stackTop;
 	Value *stackLast;
 	Value *base;
+	uint32_t *ip;	// Where the innermost Xan frame was when it last called out of the interpreter.
 
 	Value exception;
 	ObjUpvalue *openUpvalues;
@@ -215,16 +250,116 @@ typedef struct {
 	ClassCompiler *currentClassCompiler;
 } thread;
 
+typedef enum {
+	GC_IDLE,
+	GC_MARK,
+	GC_SWEEP,
+} GCPhase;
+
+typedef enum {
+	MARKER_IDLE,
+	MARKER_RUNNING,
+	MARKER_EXIT,
+} MarkerState;
+
+typedef struct sArenaPage ArenaPage;
+
 typedef struct {
-	Obj *objects;
-	Obj **grayStack;
+	ArenaPage *available[ARENA_LISTS];		// For each size class of buffers, then of objects, the pages with a free cell.
+	ArenaPage *unswept[ARENA_CLASSES];		// For each size class, the object pages the current major cycle hasn't swept yet.
+	ArenaPage *pages;
+	size_t pageCount;
+} Arena;
+
+typedef struct {
+	void *pointer;
+	size_t size;
+} DeferredFree;
+
+typedef struct {
+	Obj **items;
+	size_t count;
+	size_t capacity;
+} ObjVector;
+
+typedef struct sGarbageCollector GarbageCollector;
+typedef struct sAllocProfile AllocProfile;
+
+// Counts of the objects of one type.  An object is counted as freed once it is swept.
+typedef struct {
+	size_t allocated;
+	size_t freed;
+	size_t bytesAllocated;	// Of the objects themselves, not the buffers they own.
+	size_t bytesFreed;
+} TypeStats;
+
+typedef struct {
+	GarbageCollector *gc;
+	Obj **items;
+	size_t count;
+	size_t capacity;
+	bool shared;		// Other threads mark the same heap, so objects are claimed atomically.
+	ObjVector weak;		// The weak tables this stack has blackened, which are cleared once marking is done.
+	ObjVector strings;	// The uninterned strings it has blackened in a major cycle, while there are weak-keyed tables.
+} GrayStack;
+
+typedef struct {
+	GrayStack gray;
+	pthread_t thread;
+} GCWorker;
+
+struct sGarbageCollector {
+	Arena arena;		// Small objects and buffers.
+	ObjVector objects;	// The old objects that aren't in the arena.  Old objects stay black between collections.
+	ObjVector young;	// Objects allocated since the last collection.
+	ObjVector dying;	// The young objects that the current major cycle is sweeping.
+	size_t sweep;		// How far GC_SWEEP has gotten through objects.
+	size_t survivors;	// GC_SWEEP moves the objects it keeps to the front of objects.
+	GrayStack gray;		// Between collections, this holds the old objects that have been written to.
 	size_t bytesAllocated;
-	size_t nextMinorGC;
+	size_t nextMinorGC;	// During a major cycle, this is when the next step runs.
 	size_t nextMajorGC;
-	size_t grayCount;
-	size_t grayCapacity;
+	size_t debt;		// Work that earlier steps ran out of time for.
+	size_t youngAfterStep;	// How many young objects there were when the last step ended.
+	size_t stepCount;
+	uint64_t pauseBudget;	// In nanoseconds.
+	size_t pauses[GC_PAUSE_BUCKETS];	// A histogram of how long each collection or step took.
+	size_t pauseCount;
+	uint64_t pauseTotal;
+	uint64_t pauseMax;
+	size_t minorCollections;
+	size_t majorCycles;
+	TypeStats types[OBJ_TYPE_COUNT];
+	AllocProfile *profile;	// NULL unless allocations are being sampled.
+	ObjTable *strings;	// The intern table, which freeing a string removes it from.
+	Obj **satb;			// White objects whose references were overwritten while the marker thread was running.
+	size_t satbCount;
+	size_t satbCapacity;
+	DeferredFree *deferred;	// Buffers freed while the workers might still be reading them.
+	size_t deferredCount;
+	size_t deferredCapacity;
+	GCWorker *workers;
+	unsigned int workerCount;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	MarkerState markerState;	// Guarded by lock.
+	GrayStack pool;				// Guarded by lock.  Gray objects waiting for a worker.
+	unsigned int idleWorkers;	// Guarded by lock.
+	unsigned int hungryWorkers;	// Workers waiting for another to share its gray objects.
+	bool concurrent;	// The workers own the gray stacks and are tracing the heap.
+	GCPhase phase;
+	bool blackMark;		// Flipping this at the start of a major cycle turns the old generation white.
+	size_t cardEpoch;	// Counts major cycles, so a card table can tell whether it has been scanned in this one.
 	bool nextGCisMajor;
-} GarbageCollector;
+	bool compact;		// Compact the arena when it gets fragmented.
+	bool weakKeyTables;	// The program has made a WeakKeyTable or EphemeronTable, so strings equal to their keys keep them.
+	bool compactPending;	// The arena is fragmented, and will be compacted when the interpreter reaches a safe point.
+	size_t compactions;
+#ifdef DEBUG_STRESS_GC
+	size_t stressCount;
+#endif /* DEBUG_STRESS_GC */
+};
 
 struct sVM {
 	GarbageCollector gc;
@@ -233,6 +368,7 @@ struct sVM {
 	ObjTable *builtinMods;
 	ObjString *initString;
 	ObjString *newString;
+	ObjString *characters[256];	// Every one byte string, so subscripting a string never allocates.
 	thread *baseThread;
 };
 
@@ -258,7 +394,7 @@ struct sObjClass {
 	bool isException;
 };
 
-#define CLASS_HEADER {OBJ_CLASS, false, true, NULL,}, &classDef, NULL
+#define CLASS_HEADER {OBJ_CLASS, false, true, false}, &classDef, NULL
 // These fields should be NULL for static class definitions, and are created by defineNativeClass.
 #define RUNTIME_CLASSDEF_FIELDS NULL, NULL, NULL
 
@@ -273,4 +409,19 @@ typedef struct {
 	NativeDef *methods;
 } ModuleDef;
 
+#if UINTPTR_MAX == UINT64_MAX
+// Size classes in the arena are a word apart, so every word added to one of these is paid for by each instance.
+XAN_STATIC_ASSERT(sizeof(ObjArray) == 48);
+XAN_STATIC_ASSERT(sizeof(ObjString) == 40);
+XAN_STATIC_ASSERT(sizeof(ObjRope) == 32);
+XAN_STATIC_ASSERT(sizeof(ObjFunction) == 40 + sizeof(Chunk));
+XAN_STATIC_ASSERT(sizeof(ObjUpvalue) == 24 + sizeof(Value));
+XAN_STATIC_ASSERT(sizeof(ObjClosure) == 40);
+XAN_STATIC_ASSERT(sizeof(ObjInstance) == 24);
+XAN_STATIC_ASSERT(sizeof(ObjBoundMethod) == 16 + sizeof(Value));
+XAN_STATIC_ASSERT(sizeof(ObjNative) == 16);
+XAN_STATIC_ASSERT(sizeof(ObjClass) == 72);
+XAN_STATIC_ASSERT(sizeof(ObjModule) == 32);
+#endif
+
 #endif /* XAN_TYPE_H */
@@ -7,12 +7,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "array.h"
 #include "builtin.h"
 #include "chunk.h"
 #include "exception.h"
+#include "gcmod.h"
 #include "memory.h"
 #include "parse.h"
+#include "profile.h"
 #include "sysmod.h"
 #include "table.h"
 #include "xanString.h"
@@ -30,17 +33,6 @@ static bool isFalsey(Value v) {
 					 || (IS_TABLE(v) && count(AS_TABLE(v)) == 0);
 }
 
-static Value concatenate(VM *vm, thread *currentThread, ObjString *b, ObjString *c) {
-	size_t length = b->length + c->length;
-	char *chars = ALLOCATE(vm, char, length+1);
-	memcpy(chars, b->chars, b->length);
-	memcpy(chars + b->length, c->chars, c->length);
-	chars[length] = '\0';
-
-	ObjString *result = takeString(vm, currentThread, chars, length);
-	return OBJ_VAL(result);
-}
-
 #define runtimeError(vm, currentThread, ...) do { \
 	ExceptionFormattedStr(vm, currentThread, __VA_ARGS__); \
 } while(false)
@@ -86,32 +78,79 @@ uint32_t* decFrame(thread *currentThread) {
 	return ip;
 }
 
-void initVM(VM *vm, int argc, char** argv, int start) {
+void initVM(VM *vm, int argc, char** argv, int start, unsigned int gcPause, unsigned int gcThreads, bool gcCompact) {
 	// Initialize VM without calling allocator.
 
 	vm->strings = NULL;
 	vm->globals = NULL;
 	vm->builtinMods = NULL;
 	vm->initString = NULL;
+	vm->baseThread = NULL;
 	vm->newString = NULL;
+	for(int c = 0; c < 256; c++)
+		vm->characters[c] = NULL;
 
 	GarbageCollector *gc = &vm->gc;
-	gc->objects = NULL;
-	gc->grayStack = NULL;
+	initArena(&gc->arena);
+	gc->objects = (ObjVector){NULL, 0, 0};
+	gc->young = (ObjVector){NULL, 0, 0};
+	gc->dying = (ObjVector){NULL, 0, 0};
+	gc->sweep = 0;
+	gc->survivors = 0;
+	gc->gray = (GrayStack){gc, NULL, 0, 0, false, {NULL, 0, 0}, {NULL, 0, 0}};
 	gc->bytesAllocated = 0;
 	gc->nextMinorGC = 256 * 1024;
 	gc->nextMajorGC = 1024 * 1024;
-	gc->grayCount = 0;
-	gc->grayCapacity = 0;
+	gc->debt = 0;
+	gc->youngAfterStep = 0;
+	gc->stepCount = 0;
+	gc->pauseBudget = (uint64_t)gcPause * 1000;
+	for(size_t i = 0; i < GC_PAUSE_BUCKETS; i++)
+		gc->pauses[i] = 0;
+	gc->pauseCount = 0;
+	gc->pauseTotal = 0;
+	gc->pauseMax = 0;
+	gc->minorCollections = 0;
+	gc->majorCycles = 0;
+	for(size_t i = 0; i < OBJ_TYPE_COUNT; i++)
+		gc->types[i] = (TypeStats){0, 0, 0, 0};
+	gc->profile = NULL;
+	gc->strings = NULL;
+	gc->satb = NULL;
+	gc->satbCount = 0;
+	gc->satbCapacity = 0;
+	gc->deferred = NULL;
+	gc->deferredCount = 0;
+	gc->deferredCapacity = 0;
+	gc->workers = NULL;
+	gc->workerCount = 0;
+	gc->idleWorkers = 0;
+	gc->hungryWorkers = 0;
+	gc->concurrent = false;
+	if(gcThreads > 0)
+		initMarker(gc, gcThreads);
+	gc->phase = GC_IDLE;
+	gc->blackMark = true;	// Statically allocated classes start out white.
+	gc->cardEpoch = 1;	// New card tables start at 0, so they are scanned whole.
 	gc->nextGCisMajor = false;
+	gc->compact = gcCompact;
+	gc->compactPending = false;
+	gc->weakKeyTables = false;
+	gc->compactions = 0;
+#ifdef DEBUG_STRESS_GC
+	gc->stressCount = 0;
+	gc->pauseBudget = 0;	// Interleave major cycles with the program as finely as possible.
+#endif /* DEBUG_STRESS_GC */
 
 	vm->baseThread = ALLOCATE_OBJ(vm, thread, OBJ_THREAD);
+	pinObject((Obj*)vm->baseThread);	// Every native holds a pointer to its thread.
 
 	vm->baseThread->tryCount = 0;
 	vm->baseThread->stack = NULL;
 	vm->baseThread->stackTop = vm->baseThread->stack + 1;
 	vm->baseThread->stackLast = NULL;
 	vm->baseThread->base = 0;
+	vm->baseThread->ip = NULL;
 	vm->baseThread->exception = NIL_VAL;
 	vm->baseThread->openUpvalues = NULL;
 	vm->baseThread->currentCompiler = NULL;
@@ -124,12 +163,18 @@ void initVM(VM *vm, int argc, char** argv, int start) {
 	vm->baseThread->stackTop = vm->baseThread->base;
 
 	incCFrame(vm, vm->baseThread, 2, 3);
-	vm->strings = newTable(vm, vm->baseThread, 0);
+	vm->strings = newWeakTable(vm, vm->baseThread, 0, &weakKeyTableDef);
+	vm->gc.strings = vm->strings;
 	vm->builtinMods = newTable(vm, vm->baseThread, 0);
 	vm->initString = copyString(vm, vm->baseThread, "init", 4);
 	vm->newString = copyString(vm, vm->baseThread, "new", 3);
+	for(int c = 0; c < 256; c++) {
+		char ch = (char)c;
+		vm->characters[c] = copyString(vm, vm->baseThread, &ch, 1);
+	}
 
 	ObjModule *builtinM = defineNativeModule(vm, vm->baseThread, &builtinDef);
+	vm->baseThread->base[1] = OBJ_VAL(builtinM);	// newTable uses base[0].
 	vm->globals = newTable(vm, vm->baseThread, 0);
 	tableSet(vm, vm->globals, OBJ_VAL(copyString(vm, vm->baseThread, "_G", 2)), OBJ_VAL(vm->globals));
 	tableAddAll(vm, builtinM->fields, vm->globals);
@@ -139,6 +184,9 @@ void initVM(VM *vm, int argc, char** argv, int start) {
 	tableSet(vm, vm->builtinMods, OBJ_VAL(SysM->name), OBJ_VAL(SysM));
 	SysInit(vm, vm->baseThread, SysM, argc, argv, start);
 
+	ObjModule *GCM = defineNativeModule(vm, vm->baseThread, &GCDef);
+	tableSet(vm, vm->builtinMods, OBJ_VAL(GCM->name), OBJ_VAL(GCM));
+
 	decCFrame(vm->baseThread);
 	assert(vm->baseThread->base == vm->baseThread->stack);
 }
@@ -146,9 +194,14 @@ void initVM(VM *vm, int argc, char** argv, int start) {
 void freeVM(VM *vm) {
 	vm->baseThread = NULL;
 	vm->strings = NULL;
+	vm->gc.strings = NULL;
 	vm->globals = NULL;
 	vm->initString = NULL;
 	vm->newString = NULL;
+	for(int c = 0; c < 256; c++)
+		vm->characters[c] = NULL;
+	freeAllocProfile(vm->gc.profile);
+	vm->gc.profile = NULL;
 	freeObjects(&vm->gc);
 	if(vm->gc.bytesAllocated > 0)
 		fprintf(stderr, "Memory manager lost %zu bytes.\n", vm->gc.bytesAllocated);
@@ -170,6 +223,24 @@ uint32_t* call(VM *vm, thread *currentThread, ObjClosure *function, Reg calleeRe
 	return function->f->chunk.code + function->f->code_offsets[codeOffset];
 }
 
+// Replaces a rope in a register of the running function with its string, for the operations that need the characters.
+static Value flattenRegister(VM *vm, thread *currentThread, int16_t reg) {
+	ObjRope *rope = AS_ROPE(currentThread->base[reg]);
+	incCFrame(vm, currentThread, 1, AS_CLOSURE(currentThread->base[-3])->f->stackUsed + 3);	// don't overwrite arguments.
+	ObjString *string = flattenRope(vm, currentThread, rope);
+	decCFrame(currentThread);
+	currentThread->base[reg] = OBJ_VAL(string);
+	return currentThread->base[reg];
+}
+
+// Natives only ever see strings.
+static void flattenArguments(VM *vm, thread *currentThread, int16_t firstReg, Reg argCount) {
+	for(int16_t reg = firstReg; reg < firstReg + argCount; reg++) {
+		if(IS_ROPE(currentThread->base[reg]))
+			flattenRegister(vm, currentThread, reg);
+	}
+}
+
 static uint32_t* callValue(VM *vm, thread *currentThread, Reg calleeReg, Reg argCount, uint32_t *ip) {
 	Value callee = currentThread->base[calleeReg];
 	if(IS_OBJ(callee)) {
@@ -227,6 +298,7 @@ static uint32_t* callValue(VM *vm, thread *currentThread, Reg calleeReg, Reg arg
 native:
 			case OBJ_NATIVE: {
 				NativeFn native = AS_NATIVE(callee);
+				flattenArguments(vm, currentThread, calleeReg + 3, argCount);
 				incCFrame(vm, currentThread, argCount, calleeReg + 2);
 				bool ret = native(vm, currentThread, argCount);
 				decCFrame(currentThread);
@@ -265,6 +337,8 @@ static bool bindMethod(VM *vm, thread *currentThread, ObjInstance *instance, Obj
 static uint32_t* invokeMethod(VM *vm, thread *currentThread, int16_t instanceReg, ObjString *name, Reg argCount, uint32_t *ip) {
 	Value inst = currentThread->base[instanceReg];
 	Value method;
+	if(IS_ROPE(inst))
+		inst = flattenRegister(vm, currentThread, instanceReg);
 	if(!HAS_PROPERTIES(inst)) {
 		runtimeError(vm, currentThread, "Only instances have properties.");
 		return NULL;
@@ -287,6 +361,7 @@ static uint32_t* invokeMethod(VM *vm, thread *currentThread, int16_t instanceReg
 		return call(vm, currentThread, AS_CLOSURE(method), instanceReg, argCount, ip);
 	assert(AS_OBJ(method)->type == OBJ_NATIVE);
 	NativeFn native = AS_NATIVE(method);
+	flattenArguments(vm, currentThread, instanceReg + 3, argCount);
 	incCFrame(vm, currentThread, argCount, instanceReg + 2);
 #ifdef DEBUG_STACK_USAGE
 		dumpStack(vm, 25);
@@ -313,11 +388,12 @@ static ObjUpvalue *captureUpvalue(VM *vm, thread *currentThread, Value *local) {
 	return ret;
 }
 
-static void closeUpvalues(thread *currentThread, Value *last) {
+static void closeUpvalues(VM *vm, thread *currentThread, Value *last) {
 	while(currentThread->openUpvalues && currentThread->openUpvalues->location >= last) {
 		ObjUpvalue *uv = currentThread->openUpvalues;
 		uv->closed = *uv->location;
 		uv->location = &uv->closed;
+		writeBarrier(vm, uv);
 		currentThread->openUpvalues = uv->next;
 	}
 }
@@ -353,6 +429,8 @@ static void defineMethod(VM *vm, Value ra, Value rb, Value rc) {
 		return INTERPRET_RUNTIME_ERROR;
 #endif
 #define READ_BYTECODE() (*ip++)
+// Before anything that might allocate, so the allocation profiler can find the line.
+#define SAVE_IP() (currentThread->ip = ip)
 #define BINARY_OPVV(valueType, op) \
 	do { \
 		Value b = currentThread->base[RB(bytecode)]; \
@@ -364,17 +442,120 @@ static void defineMethod(VM *vm, Value ra, Value rb, Value rc) {
 			goto exception_unwind; \
 		} \
 	} while(false)
-#define BINARY_OPVK(valueType, op) \
+#define BINARY_OPVK(valueType, op, k) \
 	do { \
 		Value b = currentThread->base[RB(bytecode)]; \
-		Value c = CURRENT_FUNCTION->chunk.constants->values[RC(bytecode)]; \
+		Value c = CURRENT_FUNCTION->chunk.constants->values[(k)]; \
 		if(!IS_NUMBER(b) || !IS_NUMBER(c)) { \
 			runtimeError(vm, currentThread, "Operands must be numbers."); \
 			goto exception_unwind; \
 		} \
 		currentThread->base[RA(bytecode)] = valueType(AS_NUMBER(b) op AS_NUMBER(c)); \
 	} while(false)
+#define ADD_VALUES(vb, vc) \
+	do { \
+		Value b = (vb); \
+		Value c = (vc); \
+		if(IS_NUMBER(b) && IS_NUMBER(c)) { \
+			currentThread->base[RA(bytecode)] = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c)); \
+		} else if(isText(b) && isText(c)) { \
+			SAVE_IP(); \
+			incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed); \
+			Value ret = concatenateValues(vm, currentThread, b, c); \
+			decCFrame(currentThread); \
+			currentThread->base[RA(bytecode)] = ret; \
+		} else { \
+			runtimeError(vm, currentThread, "Operands must be two numbers or two strings."); \
+			goto exception_unwind; \
+		} \
+	} while(false)
+// A rope is only turned into a string when something needs its characters.
+#define FLATTEN(reg) \
+	do { \
+		if(IS_ROPE(currentThread->base[(reg)])) { \
+			SAVE_IP(); \
+			flattenRegister(vm, currentThread, (reg)); \
+		} \
+	} while(false)
+// Strings made at runtime are interned when they are first compared or used as a key, so equal strings are then the same object.
+#define INTERN(reg) \
+	do { \
+		if(IS_STRING(currentThread->base[(reg)]) && !AS_STRING(currentThread->base[(reg)])->interned) { \
+			SAVE_IP(); \
+			currentThread->base[(reg)] = OBJ_VAL(internString(vm, AS_STRING(currentThread->base[(reg)]))); \
+		} \
+	} while(false)
+#define INTERN_OPERANDS(rb, rc) \
+	do { \
+		FLATTEN(rb); \
+		FLATTEN(rc); \
+		if(IS_STRING(currentThread->base[(rb)]) && IS_STRING(currentThread->base[(rc)])) { \
+			INTERN(rb); \
+			INTERN(rc); \
+		} \
+	} while(false)
+#define MOD_VALUES(vb, vc) \
+	do { \
+		Value b = (vb); \
+		Value c = (vc); \
+		if(!IS_NUMBER(b) || !IS_NUMBER(c)) { \
+			runtimeError(vm, currentThread, "Operands must be numbers."); \
+			goto exception_unwind; \
+		} \
+		currentThread->base[RA(bytecode)] = NUMBER_VAL(fmod(AS_NUMBER(b), AS_NUMBER(c))); \
+	} while(false)
+#define GET_PROPERTYK(k) \
+	do { \
+		int16_t rb = ((int16_t)(Reg)(RB(bytecode) + 1))-1; \
+		FLATTEN(rb); \
+		Value v = currentThread->base[rb]; \
+		if(HAS_PROPERTIES(v)) { \
+			ObjInstance *instance = AS_INSTANCE(v); \
+			Value name = CURRENT_FUNCTION->chunk.constants->values[(k)]; \
+			assert(IS_STRING(name)); \
+			if((!(IS_ARRAY(v) || IS_STRING(v))) && (tableGet(instance->fields, name, &currentThread->base[RA(bytecode)]))) { \
+				DISPATCH; \
+			} \
+			SAVE_IP(); \
+			if(bindMethod(vm, currentThread, instance, instance->klass, name, RA(bytecode))) { \
+				DISPATCH; \
+			} \
+			goto exception_unwind; \
+		} else { \
+			runtimeError(vm, currentThread, "Only instances have properties."); \
+			goto exception_unwind; \
+		} \
+	} while(false)
+#define SET_PROPERTYK(k) \
+	do { \
+		int16_t rb = ((int16_t)(Reg)(RB(bytecode) + 1))-1; \
+		Value v = currentThread->base[rb]; \
+		if(HAS_PROPERTIES(v)) { \
+			ObjInstance *instance = AS_INSTANCE(v); \
+			Value name = CURRENT_FUNCTION->chunk.constants->values[(k)]; \
+			assert(IS_STRING(name)); \
+			if(!(IS_ARRAY(v) || IS_STRING(v))) { \
+				tableSet(vm, instance->fields, name, currentThread->base[RA(bytecode)]); \
+				DISPATCH; \
+			} \
+		} \
+		runtimeError(vm, currentThread, "Only instances have fields."); \
+		goto exception_unwind; \
+	} while(false)
 #define READ_STRING() AS_STRING(CURRENT_FUNCTION->chunk.constants->values[RD(bytecode)])
+static inline bool isText(Value v) {
+	return IS_STRING(v) || IS_ROPE(v);
+}
+
+static inline bool forLoopContinues(Reg cmp, double index, double limit) {
+	switch(cmp) {
+		case OP_LESS:    return index < limit;
+		case OP_LEQ:     return index <= limit;
+		case OP_GREATER: return index > limit;
+		default:         return index >= limit;
+	}
+}
+
 InterpretResult run(VM *vm, thread *currentThread) {
 #ifdef COMPUTED_GOTO
 	#define BUILD_GOTOS(op, _) &&TARGET_##op
@@ -443,12 +624,14 @@ InterpretResult run(VM *vm, thread *currentThread) {
 				DISPATCH;
 			}
 			TARGET(OP_EQUAL): {
+				INTERN_OPERANDS(RB(bytecode), RC(bytecode));
 				Value b = currentThread->base[RB(bytecode)];
 				Value c = currentThread->base[RC(bytecode)];
 				currentThread->base[RA(bytecode)] = BOOL_VAL(valuesEqual(b, c));
 				DISPATCH;
 			}
 			TARGET(OP_NEQ): {
+				INTERN_OPERANDS(RB(bytecode), RC(bytecode));
 				Value b = currentThread->base[RB(bytecode)];
 				Value c = currentThread->base[RC(bytecode)];
 				currentThread->base[RA(bytecode)] = BOOL_VAL(!valuesEqual(b, c));
@@ -458,63 +641,32 @@ InterpretResult run(VM *vm, thread *currentThread) {
 			TARGET(OP_GEQ):      BINARY_OPVV(BOOL_VAL, >=); DISPATCH;
 			TARGET(OP_LESS):     BINARY_OPVV(BOOL_VAL, <); DISPATCH;
 			TARGET(OP_LEQ):      BINARY_OPVV(BOOL_VAL, <=); DISPATCH;
-			TARGET(OP_ADDVV): {
-				Value b = currentThread->base[RB(bytecode)];
-				Value c = currentThread->base[RC(bytecode)];
-				if(IS_STRING(b) && IS_STRING(c)) {
-					incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed);
-					Value ret = concatenate(vm, currentThread, AS_STRING(b), AS_STRING(c));
-					decCFrame(currentThread);
-					currentThread->base[RA(bytecode)] = ret;
-				} else if(IS_NUMBER(b) && IS_NUMBER(c)) {
-					currentThread->base[RA(bytecode)] = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
-				} else {
-					runtimeError(vm, currentThread, "Operands must be two numbers or two strings.");
-					goto exception_unwind;
-				}
-				DISPATCH;
-			}
+			TARGET(OP_ADDVV):	  ADD_VALUES(currentThread->base[RB(bytecode)], currentThread->base[RC(bytecode)]); DISPATCH;
 			TARGET(OP_SUBVV):	  BINARY_OPVV(NUMBER_VAL, -); DISPATCH;
 			TARGET(OP_MULVV):	  BINARY_OPVV(NUMBER_VAL, *); DISPATCH;
 			TARGET(OP_DIVVV):	  BINARY_OPVV(NUMBER_VAL, /); DISPATCH;
-			TARGET(OP_MODVV): {
-				Value b = currentThread->base[RB(bytecode)];
-				Value c = currentThread->base[RC(bytecode)];
-				if(!IS_NUMBER(b) || !IS_NUMBER(c)) {
-					runtimeError(vm, currentThread, "Operands must be numbers.");
-					goto exception_unwind;
-				}
-				currentThread->base[RA(bytecode)] = NUMBER_VAL(fmod(AS_NUMBER(b), AS_NUMBER(c)));
-				DISPATCH;
-			}
-			TARGET(OP_ADDVK): {
-				Value b = currentThread->base[RB(bytecode)];
-				Value c = CURRENT_FUNCTION->chunk.constants->values[RC(bytecode)]; \
-				if(IS_STRING(b) && IS_STRING(c)) {
-					incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed);
-					Value ret = concatenate(vm, currentThread, AS_STRING(b), AS_STRING(c));
-					decCFrame(currentThread);
-					currentThread->base[RA(bytecode)] = ret;
-				} else if(IS_NUMBER(b) && IS_NUMBER(c)) {
-					currentThread->base[RA(bytecode)] = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
-				} else {
-					runtimeError(vm, currentThread, "Operands must be two numbers or two strings.");
-					goto exception_unwind;
-				}
-				DISPATCH;
-			}
-			TARGET(OP_SUBVK):	  BINARY_OPVK(NUMBER_VAL, -); DISPATCH;
-			TARGET(OP_MULVK):	  BINARY_OPVK(NUMBER_VAL, *); DISPATCH;
-			TARGET(OP_DIVVK):	  BINARY_OPVK(NUMBER_VAL, /); DISPATCH;
-			TARGET(OP_MODVK): {
-				Value b = currentThread->base[RB(bytecode)];
-				Value c = CURRENT_FUNCTION->chunk.constants->values[RC(bytecode)]; \
-				if(!IS_NUMBER(b) || !IS_NUMBER(c)) {
-					runtimeError(vm, currentThread, "Operands must be numbers.");
-					goto exception_unwind;
+			TARGET(OP_MODVV):	  MOD_VALUES(currentThread->base[RB(bytecode)], currentThread->base[RC(bytecode)]); DISPATCH;
+			TARGET(OP_ADDVK):	  ADD_VALUES(currentThread->base[RB(bytecode)], CURRENT_FUNCTION->chunk.constants->values[RC(bytecode)]); DISPATCH;
+			TARGET(OP_SUBVK):	  BINARY_OPVK(NUMBER_VAL, -, RC(bytecode)); DISPATCH;
+			TARGET(OP_MULVK):	  BINARY_OPVK(NUMBER_VAL, *, RC(bytecode)); DISPATCH;
+			TARGET(OP_DIVVK):	  BINARY_OPVK(NUMBER_VAL, /, RC(bytecode)); DISPATCH;
+			TARGET(OP_MODVK):	  MOD_VALUES(currentThread->base[RB(bytecode)], CURRENT_FUNCTION->chunk.constants->values[RC(bytecode)]); DISPATCH;
+			TARGET(OP_EXTENDED): {	// RD = high bits of the constant in the next instruction's RC.
+				size_t k = ((size_t)RD(bytecode) << 8);
+				bytecode = READ_BYTECODE();
+				k |= RC(bytecode);
+				switch(OP(bytecode)) {
+					case OP_ADDVK: ADD_VALUES(currentThread->base[RB(bytecode)], CURRENT_FUNCTION->chunk.constants->values[k]); DISPATCH;
+					case OP_SUBVK: BINARY_OPVK(NUMBER_VAL, -, k); DISPATCH;
+					case OP_MULVK: BINARY_OPVK(NUMBER_VAL, *, k); DISPATCH;
+					case OP_DIVVK: BINARY_OPVK(NUMBER_VAL, /, k); DISPATCH;
+					case OP_MODVK: MOD_VALUES(currentThread->base[RB(bytecode)], CURRENT_FUNCTION->chunk.constants->values[k]); DISPATCH;
+					case OP_GET_PROPERTYK: GET_PROPERTYK(k);
+					case OP_SET_PROPERTYK: SET_PROPERTYK(k);
+					default:
+						assert(false);
+						DISPATCH;
 				}
-				currentThread->base[RA(bytecode)] = NUMBER_VAL(fmod(AS_NUMBER(b), AS_NUMBER(c)));
-				DISPATCH;
 			}
 			TARGET(OP_RETURN): {
 				if(currentThread->base == currentThread->stack + 3)
@@ -526,17 +678,20 @@ InterpretResult run(VM *vm, thread *currentThread) {
 				ip = decFrame(currentThread);
 				assert((OP(*(ip-1)) == OP_CALL) || (OP(*(ip-1)) == OP_INVOKE));
 				// __attribute__((unused)) uint16_t nReturn = RB(*(ip - 1));
-				closeUpvalues(currentThread, oldBase - 1);
+				closeUpvalues(vm, currentThread, oldBase - 1);
 				// ensure we close this in oldBase[-1] as an upvalue before moving return value.
 				for(size_t i = 0; i < count; i++) {
 					oldBase[-3 + i] = oldBase[ra + i];
 				}
+				// Nothing here points into the heap except the thread, which is pinned, and ip, which points into a buffer.
+				if(vm->gc.compactPending)
+					compactHeap(vm);
 				DISPATCH;
 			}
 			TARGET(OP_JUMP):
 OP_JUMP:
-				assert(RJump(bytecode) != -1);
-				ip += RJump(bytecode);
+				assert(RJumpLong(bytecode) != -1);
+				ip += RJumpLong(bytecode);
 				DISPATCH;
 			TARGET(OP_COPY_JUMP_IF_FALSE):
 				currentThread->base[RA(bytecode)] = currentThread->base[RD(bytecode)];
@@ -565,6 +720,7 @@ OP_JUMP:
 				DISPATCH;
 			TARGET(OP_CALL): {	// RA = func/dest reg; RB = retCount(used by OP_CALL when call returns); RC = argCount
 				uint32_t *new_ip;
+				SAVE_IP();
 				if((new_ip = callValue(vm, currentThread, RA(bytecode), RC(bytecode), ip)) == NULL)
 					goto exception_unwind;
 				ip = new_ip;
@@ -575,11 +731,15 @@ OP_JUMP:
 				DISPATCH;
 			}
 			TARGET(OP_SET_UPVAL): {
-				*AS_CLOSURE(currentThread->base[-3])->upvalues[RA(bytecode)]->location = currentThread->base[RD(bytecode)];
+				ObjUpvalue *uv = AS_CLOSURE(currentThread->base[-3])->upvalues[RA(bytecode)];
+				satbBarrier(vm, *uv->location);
+				*uv->location = currentThread->base[RD(bytecode)];
+				writeBarrier(vm, uv);	// In case it's closed.
 				DISPATCH;
 			}
 			TARGET(OP_CLOSURE): {
 				ObjFunction *f = AS_FUNCTION(CURRENT_FUNCTION->chunk.constants->values[RD(bytecode)]);
+				SAVE_IP();
 				ObjClosure *cl = newClosure(vm, f);
 				currentThread->base[RA(bytecode)] = OBJ_VAL(cl);	// Can be found by GC
 				for(size_t i=0; i<f->uvCount; i++) {
@@ -592,10 +752,11 @@ OP_JUMP:
 				DISPATCH;
 			}
 			TARGET(OP_CLOSE_UPVALUES):
-				closeUpvalues(currentThread, currentThread->base + RA(bytecode));
+				closeUpvalues(vm, currentThread, currentThread->base + RA(bytecode));
 				DISPATCH;
 			TARGET(OP_CLASS): {
 				ObjString *name = READ_STRING();
+				SAVE_IP();
 				incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed + 1);
 				ObjClass *klass = newClass(vm, currentThread, name);
 				decCFrame(currentThread);
@@ -604,6 +765,7 @@ OP_JUMP:
 			}
 			TARGET(OP_GET_PROPERTY): {	// RA = dest reg; RB = object reg; RC = property reg
 				int16_t rb = ((int16_t)(Reg)(RB(bytecode) + 1))-1;
+				FLATTEN(rb);
 				Value v = currentThread->base[rb];
 				if(HAS_PROPERTIES(v)) {
 					ObjInstance *instance = AS_INSTANCE(v);
@@ -611,7 +773,9 @@ OP_JUMP:
 					assert(IS_STRING(name));
 					if((!(IS_ARRAY(v) || IS_STRING(v))) && (tableGet(instance->fields, name, &currentThread->base[RA(bytecode)]))) {
 						DISPATCH;
-					} else if(bindMethod(vm, currentThread, instance, instance->klass, name, RA(bytecode))) {
+					}
+					SAVE_IP();
+					if(bindMethod(vm, currentThread, instance, instance->klass, name, RA(bytecode))) {
 						DISPATCH;
 					}
 					goto exception_unwind;
@@ -635,43 +799,13 @@ OP_JUMP:
 				runtimeError(vm, currentThread, "Only instances have fields.");
 				goto exception_unwind;
 			}
-			TARGET(OP_GET_PROPERTYK): {	// RA = dest reg; RB = object reg; RC = property in Constants
-				int16_t rb = ((int16_t)(Reg)(RB(bytecode) + 1))-1;
-				Value v = currentThread->base[rb];
-				if(HAS_PROPERTIES(v)) {
-					ObjInstance *instance = AS_INSTANCE(v);
-					Value name = CURRENT_FUNCTION->chunk.constants->values[RC(bytecode)];
-					assert(IS_STRING(name));
-					if((!(IS_ARRAY(v) || IS_STRING(v))) && (tableGet(instance->fields, name, &currentThread->base[RA(bytecode)]))) {
-						DISPATCH;
-					} else if(bindMethod(vm, currentThread, instance, instance->klass, name, RA(bytecode))) {
-						DISPATCH;
-					}
-					goto exception_unwind;
-				} else {
-					runtimeError(vm, currentThread, "Only instances have properties.");
-					goto exception_unwind;
-				}
-			}
-			TARGET(OP_SET_PROPERTYK): {
-				int16_t rb = ((int16_t)(Reg)(RB(bytecode) + 1))-1;
-				Value v = currentThread->base[rb];
-				if(HAS_PROPERTIES(v)) {
-					ObjInstance *instance = AS_INSTANCE(v);
-					Value name = CURRENT_FUNCTION->chunk.constants->values[RC(bytecode)];
-					assert(IS_STRING(name));
-					if(!(IS_ARRAY(v) || IS_STRING(v))) {
-						tableSet(vm, instance->fields, name, currentThread->base[RA(bytecode)]);
-						DISPATCH;
-					}
-				}
-				runtimeError(vm, currentThread, "Only instances have fields.");
-				goto exception_unwind;
-			}
+			TARGET(OP_GET_PROPERTYK): GET_PROPERTYK(RC(bytecode));	// RA = dest reg; RB = object reg; RC = property in Constants
+			TARGET(OP_SET_PROPERTYK): SET_PROPERTYK(RC(bytecode));
 			TARGET(OP_INVOKE): {	// RA = object/dest reg; RA + 1 = property reg; RB = retCount; RC = argCount
 				int16_t ra = ((int16_t)(Reg)(RA(bytecode) + 1))-1;
 				ObjString *name = AS_STRING(currentThread->base[ra+1]);
 				uint32_t *new_ip;
+				SAVE_IP();
 				if((new_ip = invokeMethod(vm, currentThread, ra, name, RC(bytecode), ip)) == NULL) {
 					goto exception_unwind;
 				}
@@ -698,11 +832,13 @@ OP_JUMP:
 				ObjClass *superclass = AS_CLASS(currentThread->base[RA(bytecode)]);
 				ObjInstance *instance = AS_INSTANCE(currentThread->base[rb]);
 				Value name = currentThread->base[RC(bytecode)];
+				SAVE_IP();
 				if(!bindMethod(vm, currentThread, instance, superclass, name, RA(bytecode)))
 					goto exception_unwind;
 				DISPATCH;
 			}
 			TARGET(OP_NEW_ARRAY):
+				SAVE_IP();
 				incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed + 1);
 				Value ret = OBJ_VAL(newArray(vm, currentThread, RD(bytecode)));
 				decCFrame(currentThread);
@@ -710,6 +846,7 @@ OP_JUMP:
 				DISPATCH;
 			TARGET(OP_DUPLICATE_ARRAY): {
 				ObjArray *src = AS_ARRAY(CURRENT_FUNCTION->chunk.constants->values[RD(bytecode)]);
+				SAVE_IP();
 				incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed + 1);
 				ObjArray *t = duplicateArray(vm, currentThread, src);
 				decCFrame(currentThread);
@@ -717,6 +854,7 @@ OP_JUMP:
 				DISPATCH;
 			}
 			TARGET(OP_NEW_TABLE):
+				SAVE_IP();
 				incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed + 1);
 				ObjTable *t = newTable(vm, currentThread, RD(bytecode));
 				decCFrame(currentThread);
@@ -724,6 +862,7 @@ OP_JUMP:
 				DISPATCH;
 			TARGET(OP_DUPLICATE_TABLE): {
 				ObjTable *src = AS_TABLE(CURRENT_FUNCTION->chunk.constants->values[RD(bytecode)]);
+				SAVE_IP();
 				incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed + 1);
 				ObjTable *t = duplicateTable(vm, currentThread, src);
 				decCFrame(currentThread);
@@ -731,6 +870,7 @@ OP_JUMP:
 				DISPATCH;
 			}
 			TARGET(OP_GET_SUBSCRIPT): {
+				FLATTEN(RB(bytecode));
 				Value v = currentThread->base[RB(bytecode)];
 				if(IS_ARRAY(v)) {
 					ObjArray *a = AS_ARRAY(v);
@@ -750,6 +890,8 @@ OP_JUMP:
 					}
 				} else if(IS_TABLE(v)) {
 					ObjTable *t = AS_TABLE(v);
+					FLATTEN(RC(bytecode));
+					INTERN(RC(bytecode));
 					v = currentThread->base[RC(bytecode)];
 					if(!(IS_STRING(v) || IS_NUMBER(v))) {
 						runtimeError(vm, currentThread, "Tables can only be subscripted by strings or numbers.");
@@ -759,6 +901,8 @@ OP_JUMP:
 						runtimeError(vm, currentThread, "Subscript out of bounds.");
 						goto exception_unwind;
 					}
+					if(isWeakTable(t))
+						keepAlive(vm, currentThread->base[RA(bytecode)]);
 				} else if(IS_STRING(v)) {
 					ObjString *s = AS_STRING(v);
 					v = currentThread->base[RC(bytecode)];
@@ -771,10 +915,7 @@ OP_JUMP:
 						runtimeError(vm, currentThread, "Subscript out of range.");
 						goto exception_unwind;
 					}
-					incCFrame(vm, currentThread, 1, CURRENT_FUNCTION->stackUsed + 1);
-					ObjString *ret = copyString(vm, currentThread, s->chars + i, 1);
-					decCFrame(currentThread);
-					currentThread->base[RA(bytecode)] = OBJ_VAL(ret);
+					currentThread->base[RA(bytecode)] = OBJ_VAL(vm->characters[(unsigned char)s->chars[i]]);
 				} else {
 					runtimeError(vm, currentThread, "Only arrays, tables, and strings can be subscripted.");
 					goto exception_unwind;
@@ -798,6 +939,8 @@ OP_JUMP:
 					setArray(vm, a, (int)n, currentThread->base[RA(bytecode)]);
 				} else if(IS_TABLE(v)) {
 					ObjTable *t = AS_TABLE(v);
+					FLATTEN(RC(bytecode));
+					INTERN(RC(bytecode));
 					v = currentThread->base[RC(bytecode)];
 					if(!(IS_STRING(v) || IS_NUMBER(v))) {
 						runtimeError(vm, currentThread, "Tables can only be subscripted by strings or numbers.");
@@ -816,7 +959,7 @@ OP_JUMP:
 				currentThread->tryCount++;
 				DISPATCH;
 			TARGET(OP_END_TRY):
-				ip += RJump(bytecode);
+				ip += RJumpLong(bytecode);
 				assert(currentThread->tryCount > 0);
 				currentThread->tryCount--;
 				DISPATCH;
@@ -827,6 +970,40 @@ OP_JUMP:
 					ip += RJump(bytecode);
 				DISPATCH;
 			}
+			TARGET(OP_FORPREP): {	// RA = index, RA + 1 = limit, RA + 2 = step; RB = comparison
+				Value *r = currentThread->base + RA(bytecode);
+				if(!IS_NUMBER(r[0]) || !IS_NUMBER(r[1])) {
+					runtimeError(vm, currentThread, "Operands must be numbers.");
+					goto exception_unwind;
+				}
+				if(!forLoopContinues(RB(bytecode), AS_NUMBER(r[0]), AS_NUMBER(r[1]))) {
+					bytecode = READ_BYTECODE();
+					assert(OP(bytecode) == OP_JUMP);
+					goto OP_JUMP;
+				}
+				ip++;
+				DISPATCH;
+			}
+			TARGET(OP_FORLOOP): {	// The body may have assigned the index, or reloaded the limit.
+				Value *r = currentThread->base + RA(bytecode);
+				if(!IS_NUMBER(r[0])) {
+					runtimeError(vm, currentThread, "Operands must be two numbers or two strings.");
+					goto exception_unwind;
+				}
+				double index = AS_NUMBER(r[0]) + AS_NUMBER(r[2]);
+				r[0] = NUMBER_VAL(index);
+				if(!IS_NUMBER(r[1])) {
+					runtimeError(vm, currentThread, "Operands must be numbers.");
+					goto exception_unwind;
+				}
+				if(forLoopContinues(RB(bytecode), index, AS_NUMBER(r[1]))) {
+					bytecode = READ_BYTECODE();
+					assert(OP(bytecode) == OP_JUMP);
+					goto OP_JUMP;
+				}
+				ip++;
+				DISPATCH;
+			}
 			DEFAULT
 			TARGET(OP_THROW): {
 				Value err = currentThread->base[RA(bytecode)];
@@ -853,7 +1030,7 @@ exception_unwind: {
 						if(IS_CLOSURE(base[-3])) {	// In a xan frame.
 							ObjFunction *f = AS_CLOSURE(base[-3])->f;
 							size_t instruction = ip - f->chunk.code - 1;	// We have already advanced ip.
-							fprintf(stderr, "[line %zu] in ", f->chunk.lines[instruction]);
+							fprintf(stderr, "[line %zu] in ", getLine(&f->chunk, instruction));
 							if(f->name == NULL) {
 								fprintf(stderr, "script\n");
 							} else {
@@ -874,6 +1051,10 @@ exception_unwind: {
 }
 #undef BINARY_OPVV
 #undef BINARY_OPVK
+#undef ADD_VALUES
+#undef MOD_VALUES
+#undef GET_PROPERTYK
+#undef SET_PROPERTYK
 #undef READ_BYTECODE
 #undef TARGET
 #undef DISPATCH
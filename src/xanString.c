@@ -1,58 +1,154 @@
 #include "xanString.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "array.h"
+#include "byteScan.h"
 #include "class.h"
 #include "exception.h"
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 
-static ObjString* allocateString(VM *vm, thread *currentThread, char *chars, size_t length, uint32_t hash) {
-	ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+// The caller fills in the characters.  It is kept in base[0], and isn't hashed or interned until internString.
+ObjString *allocateString(VM *vm, thread *currentThread, size_t length) {
+	ObjString *string = (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING, vm);
 	string->length = length;
-	string->chars = chars;
-	string->hash = hash;
+	string->hash = 0;
+	string->interned = false;
 	string->fields = NULL;
 	string->klass = &stringDef;
+	string->chars[length] = '\0';
 	currentThread->base[0] = OBJ_VAL(string);
-	tableSet(vm, vm->strings, OBJ_VAL(string), NIL_VAL);
-
 	return string;
 }
 
-static uint32_t hashString(const char *key, size_t length) {
-	uint32_t hash = 2166136261u;
-
-	for(size_t i=0; i<length; i++) {
-		hash ^= key[i];
-		hash *= 16777619;
+// Strings made at runtime are interned the first time they are compared or used as a key.  If an equal string is
+// already interned, that is returned, and this one is left for the collector.
+ObjString *internString(VM *vm, ObjString *string) {
+	if(string->interned)
+		return string;
+	uint32_t hash = hashBytes(string->chars, string->length);
+	ObjString *interned = tableFindString(vm->strings, string->chars, string->length, hash);
+	if(interned) {
+		keepInterned(vm, interned);
+		return interned;
 	}
-
-	return hash;
+	string->hash = hash;
+	string->interned = true;	// Before tableSet, which interns its string keys.
+	tableSet(vm, vm->strings, OBJ_VAL(string), NIL_VAL);
+	return string;
 }
 
-ObjString *takeString(VM *vm, thread *currentThread, char *chars, size_t length) {
-	uint32_t hash = hashString(chars, length);
+ObjString* copyString(VM *vm, thread *currentThread, const char *chars, size_t length) {
+	uint32_t hash = hashBytes(chars, length);
 	ObjString *interned = tableFindString(vm->strings, chars, length, hash);
 	if(interned) {
-		FREE_ARRAY(&vm->gc, char, chars, length+1);
+		keepInterned(vm, interned);
 		return interned;
 	}
-	return allocateString(vm, currentThread, chars, length, hash);
+
+	ObjString *string = allocateString(vm, currentThread, length);
+	memcpy(string->chars, chars, length);
+	string->hash = hash;
+	string->interned = true;
+	tableSet(vm, vm->strings, OBJ_VAL(string), NIL_VAL);
+	return string;
 }
 
-ObjString* copyString(VM *vm, thread *currentThread, const char *chars, size_t length) {
-	uint32_t hash = hashString(chars, length);
-	ObjString *interned = tableFindString(vm->strings, chars, length, hash);
-	if(interned) return interned;
+ObjString *concatenate(VM *vm, thread *currentThread, ObjString *b, ObjString *c) {
+	// The caller is responsible for ensuring that b and c are findable by the GC.
+	ObjString *string = allocateString(vm, currentThread, b->length + c->length);
+	memcpy(string->chars, b->chars, b->length);
+	memcpy(string->chars + b->length, c->chars, c->length);
+	return string;
+}
+
+// A rope that has been flattened stands for its string.
+static inline Obj *ropePart(Obj *o) {
+	if((o->type == OBJ_ROPE) && (((ObjRope*)o)->right == NULL))
+		return ((ObjRope*)o)->left;
+	return o;
+}
+
+static inline size_t partLength(Obj *o) {
+	return (o->type == OBJ_ROPE) ? ((ObjRope*)o)->length : ((ObjString*)o)->length;
+}
+
+// b and c are each a string or a rope.  Short results are copied at once, and longer ones are left as a rope until something needs their characters.
+Value concatenateValues(VM *vm, thread *currentThread, Value b, Value c) {
+	// The caller is responsible for ensuring that b and c are findable by the GC.
+	Obj *left = ropePart(AS_OBJ(b));
+	Obj *right = ropePart(AS_OBJ(c));
+	if(partLength(right) == 0)
+		return OBJ_VAL(left);
+	if(partLength(left) == 0)
+		return OBJ_VAL(right);
+	size_t length = partLength(left) + partLength(right);
+	if((length < ROPE_MIN_LENGTH) && (left->type == OBJ_STRING) && (right->type == OBJ_STRING))
+		return OBJ_VAL(concatenate(vm, currentThread, (ObjString*)left, (ObjString*)right));
+
+	ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->left = left;
+	rope->right = right;
+	return OBJ_VAL(rope);
+}
 
-	char *heapChars = ALLOCATE(vm, char, length+1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
+// The caller keeps the rope where the GC can find it.  The string is kept in the rope, so later uses don't copy it again.
+ObjString *flattenRope(VM *vm, thread *currentThread, ObjRope *rope) {
+	if(rope->right == NULL)
+		return (ObjString*)rope->left;
+	ObjString *string = allocateString(vm, currentThread, rope->length);
 
-	return allocateString(vm, currentThread, heapChars, length, hash);
+	// Filled from the end, so a rope built by appending only ever has one node pending.
+	char *end = string->chars + rope->length;
+	ObjVector pending = {NULL, 0, 0};
+	for(Obj *o = (Obj*)rope;;) {
+		o = ropePart(o);
+		if(o->type == OBJ_ROPE) {
+			pushObject(&pending, ((ObjRope*)o)->left);
+			o = ((ObjRope*)o)->right;
+			continue;
+		}
+		ObjString *part = (ObjString*)o;
+		end -= part->length;
+		memcpy(end, part->chars, part->length);
+		if(pending.count == 0)
+			break;
+		o = pending.items[--pending.count];
+	}
+	free(pending.items);
+	assert(end == string->chars);
+
+	satbBarrier(vm, OBJ_VAL(rope->left));
+	satbBarrier(vm, OBJ_VAL(rope->right));
+	rope->left = (Obj*)string;
+	rope->right = NULL;
+	writeBarrier(vm, rope);
+	return string;
+}
+
+// Writes the characters in order, without allocating, so it is safe in error messages and while debugging the GC.
+void fprintRope(FILE *restrict stream, ObjRope *rope) {
+	ObjVector pending = {NULL, 0, 0};
+	for(Obj *o = (Obj*)rope;;) {
+		o = ropePart(o);
+		if(o->type == OBJ_ROPE) {
+			pushObject(&pending, ((ObjRope*)o)->right);
+			o = ((ObjRope*)o)->left;
+			continue;
+		}
+		fwrite(((ObjString*)o)->chars, 1, ((ObjString*)o)->length, stream);
+		if(pending.count == 0)
+			break;
+		o = pending.items[--pending.count];
+	}
+	free(pending.items);
 }
 
 static bool stringLength(VM *vm, thread *currentThread, int argCount) {
@@ -65,8 +161,243 @@ static bool stringLength(VM *vm, thread *currentThread, int argCount) {
 	return true;
 }
 
+static bool expectArguments(VM *vm, thread *currentThread, const char *name, int argCount, int min, int max) {
+	if((argCount < min) || (argCount > max)) {
+		ExceptionFormattedStr(vm, currentThread, "Method '%s' of class 'string' expected %d argument but got %d.", name, argCount < min ? min : max, argCount);
+		return false;
+	}
+	return true;
+}
+
+static bool expectString(VM *vm, thread *currentThread, const char *name, Value v) {
+	if(IS_STRING(v))
+		return true;
+	ExceptionFormattedStr(vm, currentThread, "Method '%s' of class 'string' expected a string.", name);
+	return false;
+}
+
+// The new strings aren't hashed until they are compared or used as a key.  base[0] is overwritten, so a method with arguments moves past them first.
+static ObjString *substring(VM *vm, thread *currentThread, ObjString *s, size_t start, size_t length) {
+	if((start == 0) && (length == s->length))
+		return s;
+	if(length == 1)
+		return vm->characters[(unsigned char)s->chars[start]];
+	ObjString *sub = allocateString(vm, currentThread, length);
+	memcpy(sub->chars, s->chars + start, length);
+	return sub;
+}
+
+static bool isSpace(char c) {
+	return isspace((unsigned char)c);
+}
+
+// The code of the byte at an index, so a loop over the characters doesn't have to compare strings.
+static bool stringByte(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "byte", argCount, 1, 1))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	Value v = currentThread->base[0];
+	if((!IS_NUMBER(v)) || (AS_NUMBER(v) != (double)(int)AS_NUMBER(v))) {
+		ExceptionFormattedStr(vm, currentThread, "Method 'byte' of class 'string' expected an integer.");
+		return false;
+	}
+	int i = (int)AS_NUMBER(v);
+	if((i < 0) || ((unsigned int)i >= s->length)) {
+		ExceptionFormattedStr(vm, currentThread, "Subscript out of range.");
+		return false;
+	}
+	currentThread->base[0] = NUMBER_VAL((unsigned char)s->chars[i]);
+	return true;
+}
+
+static bool stringFind(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "find", argCount, 1, 2) || !expectString(vm, currentThread, "find", currentThread->base[0]))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	ObjString *needle = AS_STRING(currentThread->base[0]);
+	size_t start = 0;
+	if(argCount == 2) {
+		Value v = currentThread->base[1];
+		if(!IS_NUMBER(v) || (AS_NUMBER(v) != (double)(int)AS_NUMBER(v)) || (AS_NUMBER(v) < 0) || (AS_NUMBER(v) > s->length)) {
+			ExceptionFormattedStr(vm, currentThread, "Method 'find' of class 'string' expected a start between 0 and the length of the string.");
+			return false;
+		}
+		start = (size_t)AS_NUMBER(v);
+	}
+	ptrdiff_t i = findBytes(s->chars + start, s->length - start, needle->chars, needle->length);
+	currentThread->base[0] = NUMBER_VAL(i < 0 ? -1 : (double)(start + i));
+	return true;
+}
+
+static bool stringContains(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "contains", argCount, 1, 1) || !expectString(vm, currentThread, "contains", currentThread->base[0]))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	ObjString *needle = AS_STRING(currentThread->base[0]);
+	currentThread->base[0] = BOOL_VAL(findBytes(s->chars, s->length, needle->chars, needle->length) >= 0);
+	return true;
+}
+
+// Occurrences that don't overlap.  The empty string occurs between each character, and at both ends.
+static size_t countOccurrences(ObjString *s, ObjString *needle) {
+	if(needle->length == 0)
+		return s->length + 1;
+	size_t count = 0;
+	for(size_t i = 0;; count++) {
+		ptrdiff_t found = findBytes(s->chars + i, s->length - i, needle->chars, needle->length);
+		if(found < 0)
+			return count;
+		i += found + needle->length;
+	}
+}
+
+static bool stringCount(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "count", argCount, 1, 1) || !expectString(vm, currentThread, "count", currentThread->base[0]))
+		return false;
+	currentThread->base[0] = NUMBER_VAL(countOccurrences(AS_STRING(currentThread->base[-1]), AS_STRING(currentThread->base[0])));
+	return true;
+}
+
+static bool stringStartsWith(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "startsWith", argCount, 1, 1) || !expectString(vm, currentThread, "startsWith", currentThread->base[0]))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	ObjString *prefix = AS_STRING(currentThread->base[0]);
+	currentThread->base[0] = BOOL_VAL((prefix->length <= s->length) && (memcmp(s->chars, prefix->chars, prefix->length) == 0));
+	return true;
+}
+
+static bool stringEndsWith(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "endsWith", argCount, 1, 1) || !expectString(vm, currentThread, "endsWith", currentThread->base[0]))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	ObjString *suffix = AS_STRING(currentThread->base[0]);
+	currentThread->base[0] = BOOL_VAL((suffix->length <= s->length)
+			&& (memcmp(s->chars + s->length - suffix->length, suffix->chars, suffix->length) == 0));
+	return true;
+}
+
+static bool stringTrim(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "trim", argCount, 0, 0))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	size_t start = 0;
+	size_t end = s->length;
+	while((start < end) && isSpace(s->chars[start]))
+		start++;
+	while((end > start) && isSpace(s->chars[end - 1]))
+		end--;
+	currentThread->base[0] = OBJ_VAL(substring(vm, currentThread, s, start, end - start));
+	return true;
+}
+
+static bool changeCaseMethod(VM *vm, thread *currentThread, int argCount, const char *name, bool upper) {
+	if(!expectArguments(vm, currentThread, name, argCount, 0, 0))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	ObjString *ret = allocateString(vm, currentThread, s->length);
+	changeCase(ret->chars, s->chars, s->length, upper);
+	currentThread->base[0] = OBJ_VAL(ret);
+	return true;
+}
+
+static bool stringUpper(VM *vm, thread *currentThread, int argCount) {
+	return changeCaseMethod(vm, currentThread, argCount, "upper", true);
+}
+
+static bool stringLower(VM *vm, thread *currentThread, int argCount) {
+	return changeCaseMethod(vm, currentThread, argCount, "lower", false);
+}
+
+static bool stringReplace(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "replace", argCount, 2, 2)
+			|| !expectString(vm, currentThread, "replace", currentThread->base[0])
+			|| !expectString(vm, currentThread, "replace", currentThread->base[1]))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	ObjString *old = AS_STRING(currentThread->base[0]);
+	ObjString *new = AS_STRING(currentThread->base[1]);
+	if(old->length == 0) {
+		ExceptionFormattedStr(vm, currentThread, "Method 'replace' of class 'string' can't replace an empty string.");
+		return false;
+	}
+	size_t count = countOccurrences(s, old);
+	if(count == 0) {
+		currentThread->base[0] = OBJ_VAL(s);
+		return true;
+	}
+
+	incCFrame(vm, currentThread, 1, argCount + 3);
+	ObjString *ret = allocateString(vm, currentThread, s->length - count * old->length + count * new->length);
+	decCFrame(currentThread);
+	char *dest = ret->chars;
+	for(size_t i = 0; count > 0; count--) {
+		size_t found = i + findBytes(s->chars + i, s->length - i, old->chars, old->length);
+		memcpy(dest, s->chars + i, found - i);
+		dest += found - i;
+		memcpy(dest, new->chars, new->length);
+		dest += new->length;
+		i = found + old->length;
+		if(count == 1)
+			memcpy(dest, s->chars + i, s->length - i);
+	}
+	currentThread->base[0] = OBJ_VAL(ret);
+	return true;
+}
+
+// With no separator, splits at runs of whitespace, and leaves out empty strings.
+static bool stringSplit(VM *vm, thread *currentThread, int argCount) {
+	if(!expectArguments(vm, currentThread, "split", argCount, 0, 1)
+			|| ((argCount == 1) && !expectString(vm, currentThread, "split", currentThread->base[0])))
+		return false;
+	ObjString *s = AS_STRING(currentThread->base[-1]);
+	ObjString *sep = argCount ? AS_STRING(currentThread->base[0]) : NULL;
+	if(sep && (sep->length == 0)) {
+		ExceptionFormattedStr(vm, currentThread, "Method 'split' of class 'string' can't split at an empty string.");
+		return false;
+	}
+
+	// base[0] holds each piece as it is added, and base[1] the array.
+	incCFrame(vm, currentThread, 2, argCount + 3);
+	ObjArray *parts = newArray(vm, currentThread, 0);
+	currentThread->base[1] = OBJ_VAL(parts);
+	for(size_t i = 0; i <= s->length;) {
+		size_t start = i;
+		size_t end;
+		if(sep) {
+			ptrdiff_t found = findBytes(s->chars + i, s->length - i, sep->chars, sep->length);
+			end = found < 0 ? s->length : i + found;
+			i = found < 0 ? s->length + 1 : end + sep->length;
+		} else {
+			while((start < s->length) && isSpace(s->chars[start]))
+				start++;
+			if(start == s->length)
+				break;
+			for(end = start; (end < s->length) && !isSpace(s->chars[end]); end++);
+			i = end;
+		}
+		ObjString *piece = substring(vm, currentThread, s, start, end - start);
+		currentThread->base[0] = OBJ_VAL(piece);
+		writeValueArray(vm, parts, OBJ_VAL(piece));
+	}
+	decCFrame(currentThread);
+	currentThread->base[0] = OBJ_VAL(parts);
+	return true;
+}
+
 NativeDef stringMethods[] = {
+	{"byte", &stringByte},
+	{"contains", &stringContains},
+	{"count", &stringCount},
+	{"endsWith", &stringEndsWith},
+	{"find", &stringFind},
 	{"length", &stringLength},
+	{"lower", &stringLower},
+	{"replace", &stringReplace},
+	{"split", &stringSplit},
+	{"startsWith", &stringStartsWith},
+	{"trim", &stringTrim},
+	{"upper", &stringUpper},
 	{NULL, NULL}
 };
 
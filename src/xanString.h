@@ -1,8 +1,15 @@
 #ifndef XAN_STRING_H
 #define XAN_STRING_H
 
+#include <stdio.h>
+
 #include "type.h"
 
 extern ObjClass stringDef;
 
+ObjString *concatenate(VM *vm, thread *currentThread, ObjString *b, ObjString *c);
+Value concatenateValues(VM *vm, thread *currentThread, Value b, Value c);
+ObjString *flattenRope(VM *vm, thread *currentThread, ObjRope *rope);
+void fprintRope(FILE *restrict stream, ObjRope *rope);
+
 #endif /* XAN_STRING_H */
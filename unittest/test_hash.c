@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/hash.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+// Run with "bench" to print the throughput and probe lengths of hashBytes next to the byte at a time FNV-1a it replaced.
+// Build it optimized first, e.g. make DEF="-O3" unittest.
+
+#define KEY_COUNT 6144	// 75% of 8192 pairs, the most a table holds before it grows.
+#define MAX_KEY 256
+
+typedef uint32_t (*HashFn)(const char *key, size_t length);
+
+static uint32_t fnv1a(const char *key, size_t length) {
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < length; i++) {
+		hash ^= key[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+// The old hash of a number, which was the number itself if it was an integer.
+static uint32_t oldNumber(double x) {
+	if((double)(int64_t)x == x)
+		return (uint32_t)(int64_t)x;
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	return (bits & 0xffffffff) ^ (bits >> 32);
+}
+
+typedef struct {
+	const char *name;
+	char keys[KEY_COUNT][MAX_KEY];
+	size_t lengths[KEY_COUNT];
+} KeySet;
+
+static void makeKeys(KeySet *set, const char *name, const char *format, int stride) {
+	set->name = name;
+	for(int i = 0; i < KEY_COUNT; i++)
+		set->lengths[i] = snprintf(set->keys[i], MAX_KEY, format, i * stride, i);
+}
+
+// Fills a table the way src/table.c probes it, and returns the mean number of slots a lookup reads.
+static double meanProbes(const uint32_t *hashes, size_t *longest) {
+	size_t capacityMask = 2 * 8192 - 1;
+	char *used = calloc(capacityMask + 1, 1);
+	size_t total = 0;
+	*longest = 0;
+	for(size_t i = 0; i < KEY_COUNT; i++) {
+		size_t index = hashes[i] & (capacityMask - 1);
+		size_t probes = 1;
+		while(used[index]) {
+			index = (index + 2) & capacityMask;
+			probes++;
+		}
+		used[index] = 1;
+		total += probes;
+		if(probes > *longest)
+			*longest = probes;
+	}
+	free(used);
+	return (double)total / KEY_COUNT;
+}
+
+static double keyProbes(KeySet *set, HashFn hash, size_t *longest) {
+	static uint32_t hashes[KEY_COUNT];
+	for(size_t i = 0; i < KEY_COUNT; i++)
+		hashes[i] = hash(set->keys[i], set->lengths[i]);
+	return meanProbes(hashes, longest);
+}
+
+static double numberProbes(double scale, uint32_t (*hash)(double), size_t *longest) {
+	static uint32_t hashes[KEY_COUNT];
+	for(size_t i = 0; i < KEY_COUNT; i++)
+		hashes[i] = hash(i * scale);
+	return meanProbes(hashes, longest);
+}
+
+static double seconds(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static volatile uint32_t sink;
+
+// Bytes hashed per second, for strings of the given length.
+static double throughput(HashFn hash, const char *data, size_t length) {
+	size_t rounds = (64 * 1024 * 1024) / length;
+	uint32_t h = 0;
+	double start = seconds();
+	for(size_t i = 0; i < rounds; i++)
+		h += hash(data + (i & 7), length);
+	double elapsed = seconds() - start;
+	sink = h;
+	return rounds * length / elapsed;
+}
+
+static KeySet sets[4];
+
+static void makeSets(void) {
+	makeKeys(&sets[0], "identifiers", "key%d", 1);
+	makeKeys(&sets[1], "sparse", "%d", 1024);
+	makeKeys(&sets[2], "paths", "/home/user/projects/data/%08d/part-%d.csv", 7);
+	makeKeys(&sets[3], "lines", "%d: The quick brown fox jumps over the lazy dog, then the report continues for a while %d", 1);
+}
+
+void test_hash_equal_keys(void) {
+	const char *a = "Equal strings hash equally, wherever they are stored.";
+	char b[64];
+	strcpy(b + 1, a);
+	assert(hashBytes(a, strlen(a)) == hashBytes(b + 1, strlen(a)));
+	assert(hashNumber(0.0) == hashNumber(-0.0));
+	assert(hashNumber(1.0) != hashNumber(2.0));
+}
+
+// Every length reads only its own bytes.
+void test_hash_lengths(void) {
+	char buffer[80];
+	memset(buffer, 'x', sizeof(buffer));
+	for(size_t length = 0; length < 72; length++) {
+		uint32_t h = hashBytes(buffer, length);
+		buffer[length] = 'y';
+		assert(hashBytes(buffer, length) == h);
+		buffer[length] = 'x';
+		if(length > 0) {
+			buffer[length - 1] = 'y';
+			assert(hashBytes(buffer, length) != h);
+			buffer[length - 1] = 'x';
+		}
+	}
+}
+
+// Linear probing at 75% load averages 2.5 probes when the low bits are well spread.
+void test_hash_probes(void) {
+	size_t longest;
+	for(size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+		assert(keyProbes(&sets[i], hashBytes, &longest) < 3.5);
+	assert(numberProbes(1, hashNumber, &longest) < 3.5);
+	assert(numberProbes(1024, hashNumber, &longest) < 3.5);
+	assert(numberProbes(0.1, hashNumber, &longest) < 3.5);
+}
+
+static void bench(void) {
+	size_t longest;
+	printf("%-12s %22s %22s\n", "probes", "FNV-1a mean (max)", "hashBytes mean (max)");
+	for(size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+		double old = keyProbes(&sets[i], fnv1a, &longest);
+		size_t oldLongest = longest;
+		double new = keyProbes(&sets[i], hashBytes, &longest);
+		printf("%-12s %15.2f (%4zu) %15.2f (%4zu)\n", sets[i].name, old, oldLongest, new, longest);
+	}
+	const double scales[] = {1, 1024, 0.1};
+	const char *names[] = {"integers", "stride 1024", "tenths"};
+	for(size_t i = 0; i < 3; i++) {
+		double old = numberProbes(scales[i], oldNumber, &longest);
+		size_t oldLongest = longest;
+		double new = numberProbes(scales[i], hashNumber, &longest);
+		printf("%-12s %15.2f (%4zu) %15.2f (%4zu)\n", names[i], old, oldLongest, new, longest);
+	}
+
+	static char data[4096 + 8];
+	for(size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+	printf("\n%-12s %22s %22s\n", "bytes", "FNV-1a MB/s", "hashBytes MB/s");
+	const size_t lengths[] = {4, 8, 16, 32, 64, 256, 4096};
+	for(size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		printf("%-12zu %22.0f %22.0f\n", lengths[i],
+				throughput(fnv1a, data, lengths[i]) / 1e6,
+				throughput(hashBytes, data, lengths[i]) / 1e6);
+	}
+}
+
+int main(int argc, char** argv) {
+	makeSets();
+	test_hash_equal_keys();
+	test_hash_lengths();
+	test_hash_probes();
+	if((argc > 1) && (strcmp(argv[1], "bench") == 0))
+		bench();
+}
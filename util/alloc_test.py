@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+
+from os.path import dirname, join, realpath
+import re
+from subprocess import Popen, PIPE
+import sys
+
+# Checks the report that -a prints to stderr against the lines of test/gc/alloc_profile.xan marked "// sampled".
+#
+#   alloc_test.py <interpreter> [interpreter flags...]
+REPO_DIR = dirname(dirname(realpath(__file__)))
+SCRIPT = 'test/gc/alloc_profile.xan'
+INTERVAL = '64'
+
+SAMPLED_EXPECT = re.compile(r'// sampled (live|dead)')
+SITE_RE = re.compile(r'^\s*(\d+)\s+(\d+)\s+(\d+)\s+(\d+)\s+(.+):(\d+)$')
+
+def expected_sites(path):
+  sites = {}
+  with open(path, 'r') as file:
+    for line_num, line in enumerate(file, 1):
+      match = SAMPLED_EXPECT.search(line)
+      if match:
+        sites[line_num] = match.group(1)
+  return sites
+
+def report(interpreter, flags, path):
+  args = [interpreter] + flags + ['-a', INTERVAL, path]
+  proc = Popen(args, stdin=PIPE, stdout=PIPE, stderr=PIPE)
+  _, err = proc.communicate()
+  if proc.returncode != 0:
+    return None, 'Exited with code {}.'.format(proc.returncode)
+  sites = {}
+  for line in err.decode('utf-8').splitlines():
+    match = SITE_RE.match(line)
+    if match:
+      sites[int(match.group(6))] = (int(match.group(2)), int(match.group(4)))
+  return sites, None
+
+def check(expected, sites):
+  failures = []
+  for line_num, state in sorted(expected.items()):
+    if line_num not in sites:
+      failures.append('Line {} is missing from the report.'.format(line_num))
+      continue
+    count, live = sites[line_num]
+    if state == 'live' and live == 0:
+      failures.append('Line {} has no live objects after collection.'.format(line_num))
+    # Registers can still hold the last few.
+    if state == 'dead' and live >= count:
+      failures.append('Line {} has {} live of {} objects after collection.'.format(line_num, live, count))
+  return failures
+
+def main(argv):
+  if len(argv) < 2:
+    print('Usage: alloc_test.py <interpreter> [interpreter flags...]')
+    return 1
+  path = join(REPO_DIR, SCRIPT)
+  sites, error = report(argv[1], argv[2:], path)
+  failures = [error] if error else check(expected_sites(path), sites)
+  if failures:
+    print('FAIL: ' + ' '.join([SCRIPT] + argv[2:]))
+    for failure in failures:
+      print('      ' + failure)
+    return 1
+  print('Allocation profile of ' + SCRIPT + ' passed.')
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv))
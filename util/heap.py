@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+
+from collections import defaultdict
+import sys
+
+# Reads the heap snapshots written by gc.snapshot(), and summarizes or compares them.
+#
+#   heap.py summary snapshot [count]   Groups the objects by type and label, largest retained size first.
+#   heap.py diff before after [count]  Shows which groups grew between two snapshots.
+
+class Snapshot:
+    def __init__(self, path):
+        self.types = []
+        self.labels = []
+        self.sizes = []
+        self.edges = []
+        self.roots = []
+        with open(path) as f:
+            header = f.readline().split()
+            if header != ['xan-heap', '1']:
+                raise ValueError(path + ' is not a heap snapshot.')
+            self.roots = [int(x) for x in f.readline().split()[1:]]
+            records = [line.split() for line in f]
+        count = len(records)
+        self.types = [None] * count
+        self.labels = [None] * count
+        self.sizes = [0] * count
+        self.edges = [None] * count
+        for r in records:
+            i = int(r[0])
+            self.types[i] = r[1]
+            self.sizes[i] = int(r[2])
+            self.labels[i] = r[3]
+            self.edges[i] = [int(x) for x in r[4:]]
+
+    def group(self, i):
+        return self.types[i] + ' ' + self.labels[i]
+
+    def retained(self):
+        """
+        Returns the size of each object plus everything that only it keeps alive, using the dominator
+        tree found by Cooper, Harvey and Kennedy's iterative algorithm.  Index len(sizes) is the
+        root of the graph, which refers to the roots.
+        """
+        n = len(self.sizes)
+        root = n
+        successors = self.edges + [self.roots]
+
+        # Depth first, without recursion, to number the objects in postorder.
+        order = []
+        seen = [False] * (n + 1)
+        seen[root] = True
+        stack = [(root, iter(successors[root]))]
+        while stack:
+            node, children = stack[-1]
+            for child in children:
+                if not seen[child]:
+                    seen[child] = True
+                    stack.append((child, iter(successors[child])))
+                    break
+            else:
+                stack.pop()
+                order.append(node)
+        postorder = [0] * (n + 1)
+        for i, node in enumerate(order):
+            postorder[node] = i
+
+        predecessors = [[] for _ in range(n + 1)]
+        for node in range(n + 1):
+            for child in successors[node]:
+                predecessors[child].append(node)
+
+        idom = [None] * (n + 1)
+        idom[root] = root
+
+        def intersect(a, b):
+            while a != b:
+                while postorder[a] < postorder[b]:
+                    a = idom[a]
+                while postorder[b] < postorder[a]:
+                    b = idom[b]
+            return a
+
+        changed = True
+        while changed:
+            changed = False
+            for node in reversed(order):
+                if node == root:
+                    continue
+                new = None
+                for p in predecessors[node]:
+                    if idom[p] is not None:
+                        new = p if new is None else intersect(p, new)
+                if new is not None and idom[node] != new:
+                    idom[node] = new
+                    changed = True
+
+        # Children come before their dominators in postorder.
+        retained = self.sizes + [0]
+        for node in order:
+            if node != root and idom[node] is not None and idom[node] != root:
+                retained[idom[node]] += retained[node]
+        self.idom = idom
+        return retained[:n]
+
+def summary(path, limit):
+    s = Snapshot(path)
+    retained = s.retained()
+    n = len(s.sizes)
+    counts = defaultdict(int)
+    sizes = defaultdict(int)
+    for i in range(n):
+        counts[s.group(i)] += 1
+        sizes[s.group(i)] += s.sizes[i]
+
+    # Members dominated by another member of their group are already counted in its retained size,
+    # so the dominator tree is walked keeping count of the groups above each object.
+    children = [[] for _ in range(n + 1)]
+    for i in range(n):
+        children[s.idom[i]].append(i)
+    kept = defaultdict(int)
+    above = defaultdict(int)
+    stack = [(c, True) for c in children[n]]
+    while stack:
+        node, entering = stack.pop()
+        g = s.group(node)
+        if entering:
+            if above[g] == 0:
+                kept[g] += retained[node]
+            above[g] += 1
+            stack.append((node, False))
+            stack.extend((c, True) for c in children[node])
+        else:
+            above[g] -= 1
+    total = sum(s.sizes)
+    print('{0} objects, {1} bytes'.format(len(s.sizes), total))
+    print('{0:>10} {1:>12} {2:>12}  {3}'.format('objects', 'bytes', 'retained', 'group'))
+    for g in sorted(kept, key=lambda g: (-kept[g], g))[:limit]:
+        print('{0:>10} {1:>12} {2:>12}  {3}'.format(counts[g], sizes[g], kept[g], g))
+
+def diff(before, after, limit):
+    old = Snapshot(before)
+    new = Snapshot(after)
+    counts = defaultdict(int)
+    sizes = defaultdict(int)
+    for i in range(len(old.sizes)):
+        counts[old.group(i)] -= 1
+        sizes[old.group(i)] -= old.sizes[i]
+    for i in range(len(new.sizes)):
+        counts[new.group(i)] += 1
+        sizes[new.group(i)] += new.sizes[i]
+    print('{0:+d} objects, {1:+d} bytes'.format(len(new.sizes) - len(old.sizes), sum(new.sizes) - sum(old.sizes)))
+    print('{0:>10} {1:>12}  {2}'.format('objects', 'bytes', 'group'))
+    changed = [g for g in sizes if counts[g] or sizes[g]]
+    for g in sorted(changed, key=lambda g: (-sizes[g], -counts[g], g))[:limit]:
+        print('{0:>+10d} {1:>+12d}  {2}'.format(counts[g], sizes[g], g))
+
+def usage():
+    print('Usage: heap.py summary snapshot [count]')
+    print('       heap.py diff before after [count]')
+    sys.exit(64)
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    if len(args) >= 2 and args[0] == 'summary':
+        summary(args[1], int(args[2]) if len(args) > 2 else 20)
+    elif len(args) >= 3 and args[0] == 'diff':
+        diff(args[1], args[2], int(args[3]) if len(args) > 3 else 20)
+    else:
+        usage()
@@ -37,7 +37,7 @@ TESTS = {
 }
 
 class Test:
-  def __init__(self, path, interpreter, results):
+  def __init__(self, path, interpreter, flags, results):
     self.path = path
     self.output = []
     self.compile_errors = set()
@@ -46,6 +46,7 @@ class Test:
     self.exit_code = 0
     self.failures = []
     self.interpreter = interpreter
+    self.flags = flags
     self.results = results
 
 
@@ -124,7 +125,7 @@ class Test:
 
   def run(self):
     # Invoke the interpreter and run the test.
-    args = [self.interpreter, self.path]
+    args = [self.interpreter] + self.flags + [self.path]
     proc = Popen(args, stdin=PIPE, stdout=PIPE, stderr=PIPE)
 
     out, err = proc.communicate()
@@ -302,12 +303,13 @@ def print_line(line=None):
     sys.stdout.flush()
 
 class Suite:
-  def __init__(self, interpreter):
+  def __init__(self, interpreter, flags):
     self.passed = 0
     self.failed = 0
     self.num_skipped = 0
     self.expectations = 0
     self.interpreter = interpreter
+    self.flags = flags
 
   def run_script(self, path):
     if "benchmark" in path: return
@@ -329,7 +331,7 @@ class Suite:
                gray(' (' + path + ')'))
 
     # Read the test and parse out the expectations.
-    test = Test(path, self.interpreter, self)
+    test = Test(path, self.interpreter, self.flags, self)
 
     if not test.parse():
       # It's a skipped or non-test file.
@@ -364,11 +366,13 @@ class Suite:
 
 
 def main(argv):
-  if len(argv) != 2:
-    print('Usage: test.py <interpreter>')
+  if len(argv) < 2:
+    print('Usage: test.py <interpreter> [interpreter flags...]')
     sys.exit(1)
 
-  Suite(argv[1]).run_suite()
+  # Flags such as "-m 2" or "-c" are passed to the interpreter before each test's path.
+  if not Suite(argv[1], argv[2:]).run_suite():
+    sys.exit(1)
 
 
 if __name__ == '__main__':